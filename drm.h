@@ -710,6 +710,8 @@ typedef struct drm_set_version {
 /**
  * Device specific ioctls should only be in their respective headers
  * The device specific ioctl range is from 0x40 to 0x79.
+ * The range from 0x80 is reserved for the kernel compatibility layer,
+ * see KCL_IOCTL_NR_BASE in firegl_public.h.
  *
  * \sa drmCommandNone(), drmCommandRead(), drmCommandWrite(), and
  * drmCommandReadWrite().
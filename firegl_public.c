@@ -97,6 +97,12 @@
     #define FIREGL_DMA_REMAPPING
 #endif
 
+/* Driver VMA arenas need a 64-bit file offset space to stay clear of the
+ * core map handles, and bitmap_find_next_zero_area. */
+#if defined(__x86_64__) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+    #define FIREGL_MEM_ARENA
+#endif
+
 // ============================================================
 
 // always defined
@@ -151,6 +157,8 @@
 
 #include <linux/poll.h>   /* for poll() */
 #include <asm/poll.h>
+#include <linux/uio.h>    /* for readv()/writev() */
+#include <linux/aio.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 #ifdef __x86_64__
@@ -165,6 +173,9 @@
 #include "asm/compat.h"
 #endif
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22) && defined(CONFIG_COMPAT)
+#include <linux/compat.h>
+#endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 #include "linux/freezer.h"
@@ -190,6 +201,10 @@
 #include <linux/string.h>
 #include <linux/gfp.h>
 #include <linux/swap.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include "asm/i387.h"
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
 #include <asm/fpu-internal.h>
@@ -198,6 +213,7 @@
 #include "firegl_public.h"
 #include "kcl_osconfig.h"
 #include "kcl_io.h"
+#include "kcl_ioctl.h"
 #include "kcl_debug.h"
 
 // ============================================================
@@ -344,35 +360,486 @@ int ip_firegl_release(struct inode* inode, struct file* filp)
     return firegl_release((KCL_IO_FILE_Handle)filp);
 }
 
+/* Per-CPU ioctl accounting, readable and resettable via /proc/ati/ioctl_stats.
+ * Counters are keyed by command number; the histogram buckets are log2 of
+ * the call latency in ns, the last bucket is open ended. Only the DRM core
+ * and driver command numbers below KCL_IOCTL_NR_BASE have counters; batch
+ * requests are accounted per sub-command.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
+#define FIREGL_IOCTL_STATS
+
+#define KCL_IOCTL_STATS_CMDS        KCL_IOCTL_NR_BASE
+#define KCL_IOCTL_STATS_BUCKETS     24
+
+typedef struct
+{
+    unsigned int cmd;               /* last full command seen with this number */
+    unsigned int calls;
+    unsigned int errors;
+    unsigned int hist[KCL_IOCTL_STATS_BUCKETS];
+} kcl_ioctl_stats_t;
+
+/* Allocated at module load before the device node exists and freed at
+ * unload after it is gone, so it does not change while ioctls can run */
+static kcl_ioctl_stats_t __percpu* kcl_ioctl_stats;
+static int kcl_ioctl_stats_enabled = 1;
+
+static void __init kcl_ioctl_stats_init(void)
+{
+    kcl_ioctl_stats = (kcl_ioctl_stats_t __percpu*)
+        __alloc_percpu(sizeof(kcl_ioctl_stats_t) * KCL_IOCTL_STATS_CMDS,
+                       __alignof__(kcl_ioctl_stats_t));
+    if (kcl_ioctl_stats == NULL)
+    {
+        KCL_DEBUG_ERROR("ioctl accounting disabled, out of memory\n");
+    }
+}
+
+static void kcl_ioctl_stats_cleanup(void)
+{
+    if (kcl_ioctl_stats)
+    {
+        free_percpu(kcl_ioctl_stats);
+        kcl_ioctl_stats = NULL;
+    }
+}
+
+static inline u64 kcl_ioctl_stats_begin(void)
+{
+    return (kcl_ioctl_stats && kcl_ioctl_stats_enabled) ? local_clock() : 0;
+}
+
+/* Account a call timed with kcl_ioctl_stats_begin, returns its duration in
+ * ns or 0 if it was not timed */
+static inline u64 kcl_ioctl_stats_end(unsigned int cmd, u64 start, long ret)
+{
+    kcl_ioctl_stats_t* stats;
+    unsigned int bucket;
+    u64 ns;
+
+    if (start == 0 || kcl_ioctl_stats == NULL)
+    {
+        return 0;
+    }
+
+    ns = local_clock() - start;
+    if (_IOC_NR(cmd) >= KCL_IOCTL_STATS_CMDS)
+    {
+        return ns;
+    }
+
+    bucket = ns ? ilog2(ns) : 0;
+    if (bucket >= KCL_IOCTL_STATS_BUCKETS)
+    {
+        bucket = KCL_IOCTL_STATS_BUCKETS - 1;
+    }
+
+    stats = get_cpu_ptr(kcl_ioctl_stats) + _IOC_NR(cmd);
+    stats->cmd = cmd;
+    stats->calls++;
+    if (ret < 0)
+    {
+        stats->errors++;
+    }
+    stats->hist[bucket]++;
+    put_cpu_ptr(kcl_ioctl_stats);
+    return ns;
+}
+#else
+static inline void kcl_ioctl_stats_init(void)
+{
+}
+
+static inline void kcl_ioctl_stats_cleanup(void)
+{
+}
+
+static inline u64 kcl_ioctl_stats_begin(void)
+{
+    return 0;
+}
+
+static inline u64 kcl_ioctl_stats_end(unsigned int cmd, u64 start, long ret)
+{
+    return 0;
+}
+#endif
+
+/* Entries copied from and to user space at once */
+#define KCL_IOCTL_BATCH_CHUNK   16
+
+#if defined(KCL_OSCONFIG_IOCTL_COMPAT) && defined(__x86_64__)
+static long firegl_compat_ioctl_cmd(struct file* filp, unsigned int cmd, unsigned long arg,
+                                    const KCL_IOCTL_CompatCmd** entry);
+#endif
+
+static atomic_t kcl_ioctl_batches = ATOMIC_INIT(0);
+static atomic_t kcl_ioctl_batch_entries = ATOMIC_INIT(0);
+
+/** \brief Execute a KCL_IOCTL_BATCH request
+ *
+ * The entries are copied in chunks, executed in order through the regular
+ * dispatch and their results copied back per chunk. Nested batches are
+ * rejected with -EINVAL in the entry result. The number of executed
+ * entries is written back to the header on every return after the header
+ * was read, including a failed copy of the entries.
+ *
+ * \param compat  the entries come from a 32-bit client [in]
+ *
+ * \return 0 if the request was processed, kernel defined error code otherwise
+ */
+static long kcl_ioctl_batch(struct file* filp, unsigned long arg, int compat)
+{
+    KCL_IOCTL_BatchHeader header;
+    KCL_IOCTL_BatchEntry entries[KCL_IOCTL_BATCH_CHUNK];
+    KCL_IOCTL_BatchEntry __user* uentries;
+    unsigned int done = 0, n, i;
+    int stop = 0;
+    long ret = 0;
+
+    if (copy_from_user(&header, (void __user*)arg, sizeof(header)))
+    {
+        return -EFAULT;
+    }
+
+    if (header.count > KCL_IOCTL_BATCH_MAX_ENTRIES)
+    {
+        return -EINVAL;
+    }
+
+    uentries = (KCL_IOCTL_BatchEntry __user*)(unsigned long)header.entries;
+
+    while (done < header.count && !stop)
+    {
+        n = min(header.count - done, (unsigned int)KCL_IOCTL_BATCH_CHUNK);
+
+        if (copy_from_user(entries, uentries + done, n * sizeof(entries[0])))
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            u64 start = kcl_ioctl_stats_begin();
+
+            if (entries[i].cmd == KCL_IOCTL_BATCH)
+            {
+                entries[i].result = -EINVAL;
+            }
+#if defined(KCL_OSCONFIG_IOCTL_COMPAT) && defined(__x86_64__)
+            else if (compat)
+            {
+                const KCL_IOCTL_CompatCmd* entry;
+
+                entries[i].result = firegl_compat_ioctl_cmd(filp, entries[i].cmd, (unsigned long)entries[i].arg, &entry);
+            }
+#endif
+            else
+            {
+                entries[i].result = firegl_ioctl((KCL_IO_FILE_Handle)filp, entries[i].cmd, (unsigned long)entries[i].arg);
+            }
+            kcl_ioctl_stats_end(entries[i].cmd, start, entries[i].result);
+
+            if (entries[i].result < 0 && (header.flags & KCL_IOCTL_BATCH_STOP_ON_ERROR))
+            {
+                stop = 1;
+                i++;
+                break;
+            }
+        }
+
+        /* The entries ran even if their results cannot be stored */
+        done += i;
+
+        if (copy_to_user(uentries + done - i, entries, i * sizeof(entries[0])))
+        {
+            ret = -EFAULT;
+            break;
+        }
+    }
+
+    atomic_inc(&kcl_ioctl_batches);
+    atomic_add(done, &kcl_ioctl_batch_entries);
+
+    header.completed = done;
+    if (copy_to_user((void __user*)arg, &header, sizeof(header)))
+    {
+        return -EFAULT;
+    }
+
+    return ret;
+}
+
 #ifdef HAVE_UNLOCKED_IOCTL
 long ip_firegl_unlocked_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
 #else
 int ip_firegl_ioctl(struct inode* inode, struct file* filp, unsigned int cmd, unsigned long arg)
 #endif
 {
-    return firegl_ioctl((KCL_IO_FILE_Handle)filp, cmd, arg);
+    u64 start;
+    int ret;
+
+    if (cmd == KCL_IOCTL_BATCH)
+    {
+        return kcl_ioctl_batch(filp, arg, 0);
+    }
+
+    start = kcl_ioctl_stats_begin();
+    ret = firegl_ioctl((KCL_IO_FILE_Handle)filp, cmd, arg);
+    kcl_ioctl_stats_end(cmd, start, ret);
+    return ret;
 }
 
+#ifdef FIREGL_MEM_ARENA
+/* Arena map offsets, far above any map handle of the core */
+#define KCL_MEM_ARENA_PGOFF_BASE    (1UL << 36)
+
+static int kcl_mem_arena_mmap(struct file* filp, struct vm_area_struct* vma);
+#endif
+
 int ip_firegl_mmap(struct file* filp, struct vm_area_struct* vma)
 { 
     int ret;
     KCL_DEBUG_TRACEIN(FN_FIREGL_MMAP, vma, NULL);
+#ifdef FIREGL_MEM_ARENA
+    if (vma->vm_pgoff >= KCL_MEM_ARENA_PGOFF_BASE)
+    {
+        ret = kcl_mem_arena_mmap(filp, vma);
+    }
+    else
+#endif
     ret = firegl_mmap((KCL_IO_FILE_Handle)filp, vma);
     KCL_DEBUG_TRACEOUT(FN_FIREGL_MMAP, ret, NULL);
     return ret;
 }
 
 #if defined(KCL_OSCONFIG_IOCTL_COMPAT) && defined(__x86_64__)
+static atomic_long_t kcl_compat_table_calls = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_compat_table_ns = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_compat_legacy_calls = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_compat_legacy_ns = ATOMIC_LONG_INIT(0);
+
+/* Small argument structs are converted on the kernel stack */
+#define KCL_COMPAT_STACK_ARG    128
+
+/** \brief Execute a table driven 32-bit ioctl
+ *
+ * The 32-bit argument is read with one copy_from_user and converted into the
+ * native struct in kernel memory. The native ioctl runs on that struct under
+ * KERNEL_DS, so it is not copied through user space again. Results are
+ * converted back and written with one copy_to_user.
+ */
+static long firegl_compat_ioctl_table(struct file* filp,
+                                      const KCL_IOCTL_CompatCmd* entry,
+                                      unsigned long arg)
+{
+    unsigned int size32 = _IOC_SIZE(entry->cmd32);
+    unsigned int size64 = _IOC_SIZE(entry->cmd64);
+    char stack32[KCL_COMPAT_STACK_ARG];
+    char stack64[KCL_COMPAT_STACK_ARG];
+    char* buf32 = stack32;
+    char* buf64 = stack64;
+    void __user* uarg = compat_ptr(arg);
+    mm_segment_t old_fs;
+    long ret;
+
+    if (size32 > KCL_COMPAT_STACK_ARG || size64 > KCL_COMPAT_STACK_ARG)
+    {
+        buf32 = kmalloc(size32 + size64, GFP_KERNEL);
+        if (buf32 == NULL)
+        {
+            return -ENOMEM;
+        }
+        buf64 = buf32 + size32;
+    }
+
+    if (_IOC_DIR(entry->cmd32) & _IOC_WRITE)
+    {
+        if (copy_from_user(buf32, uarg, size32))
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+    }
+    else
+    {
+        memset(buf32, 0, size32);
+    }
+
+    memset(buf64, 0, size64);
+    KCL_IOCTL_CompatToNative(entry, buf64, buf32);
+
+    /* Nested user addresses are compat pointers below 4GB (kcl_ioctl.h),
+     * so they stay user addresses under KERNEL_DS */
+    old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    ret = firegl_ioctl((KCL_IO_FILE_Handle)filp, entry->cmd64, (unsigned long)buf64);
+    set_fs(old_fs);
+
+    if (ret >= 0 && (_IOC_DIR(entry->cmd32) & _IOC_READ))
+    {
+        KCL_IOCTL_NativeToCompat(entry, buf32, buf64);
+        if (copy_to_user(uarg, buf32, size32))
+        {
+            ret = -EFAULT;
+        }
+    }
+
+out:
+    if (buf32 != stack32)
+    {
+        kfree(buf32);
+    }
+    return ret;
+}
+
+/* Run a 32-bit command through its translation table if it has one */
+static long firegl_compat_ioctl_cmd(struct file* filp, unsigned int cmd, unsigned long arg,
+                                    const KCL_IOCTL_CompatCmd** entry)
+{
+    *entry = KCL_IOCTL_FindCompat(cmd);
+    if (*entry)
+    {
+        return firegl_compat_ioctl_table(filp, *entry, arg);
+    }
+    return firegl_compat_ioctl((KCL_IO_FILE_Handle)filp, cmd, arg);
+}
+
 long ip_firegl_compat_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
 { 
+    const KCL_IOCTL_CompatCmd* entry;
+    u64 start;
+    u64 ns;
     long ret;
+
+    /* The batch layout is the same for 32-bit clients */
+    if (cmd == KCL_IOCTL_BATCH)
+    {
+        return kcl_ioctl_batch(filp, (unsigned long)compat_ptr(arg), 1);
+    }
+
     KCL_DEBUG_TRACEIN(FN_FIREGL_COMPAT_IOCTL, cmd, NULL);
-    ret = firegl_compat_ioctl((KCL_IO_FILE_Handle)filp, cmd, arg);
+    start = kcl_ioctl_stats_begin();
+    ret = firegl_compat_ioctl_cmd(filp, cmd, arg, &entry);
+
+    /* Only timed calls are counted, so the averages stay consistent */
+    ns = kcl_ioctl_stats_end(cmd, start, ret);
+    if (start)
+    {
+        atomic_long_inc(entry ? &kcl_compat_table_calls : &kcl_compat_legacy_calls);
+        atomic_long_add(ns, entry ? &kcl_compat_table_ns : &kcl_compat_legacy_ns);
+    }
     KCL_DEBUG_TRACEOUT(FN_FIREGL_COMPAT_IOCTL, ret, NULL);
     return ret;
 }
 #endif
 
+static atomic_t kcl_asyncio_bulk_reads = ATOMIC_INIT(0);
+static atomic_t kcl_asyncio_bulk_read_msgs = ATOMIC_INIT(0);
+static atomic_t kcl_asyncio_vec_writes = ATOMIC_INIT(0);
+static atomic_t kcl_asyncio_vec_write_msgs = ATOMIC_INIT(0);
+
+/* Read asyncio messages into a list of user buffers.
+ *
+ * This is the bulk drain of the device node: every buffer takes one
+ * message, as a read() into that buffer would, so the caller sizes each
+ * buffer for a full message and the message boundaries are kept. The size
+ * of the next message is not known in advance, so buffers are never shared
+ * between messages and read() itself stays one message per call.
+ *
+ * Only the first message of a blocking file may wait. Further messages, and
+ * every message of an O_NONBLOCK file, are read only while the poll state
+ * reports queued data, so a readv drains what is queued without waiting for
+ * more. If a concurrent reader takes the polled message first, the core
+ * read of an O_NONBLOCK file fails with -EAGAIN instead of sleeping and the
+ * drain ends there; on a blocking file it waits as a read() would.
+ */
+static kcl_ssize_t firegl_asyncio_readv(struct file *filp,
+                                        const struct iovec *iov,
+                                        unsigned long nr_segs,
+                                        kcl_size_t skip,
+                                        kcl_loff_t *off_ptr)
+{
+    kcl_ssize_t done = 0;
+    unsigned int msgs = 0;
+    unsigned long seg;
+    kcl_ssize_t ret = 0;
+    int nonblock = (filp->f_flags & O_NONBLOCK) != 0;
+
+    for (seg = 0; seg < nr_segs; seg++, skip = 0)
+    {
+        char __user *buf = (char __user *)iov[seg].iov_base + skip;
+        kcl_size_t len = iov[seg].iov_len - skip;
+
+        if (len == 0)
+        {
+            continue;
+        }
+
+        if (done > 0 || nonblock)
+        {
+            unsigned int mask = firegl_asyncio_poll((KCL_IO_FILE_Handle)filp, NULL);
+
+            if (!(mask & POLLIN))
+            {
+                ret = -EAGAIN;
+                break;
+            }
+        }
+
+        ret = firegl_asyncio_read((KCL_IO_FILE_Handle)filp, buf, len, off_ptr);
+        if (ret <= 0)
+        {
+            break;
+        }
+
+        done += ret;
+        msgs++;
+    }
+
+    if (msgs > 1)
+    {
+        atomic_inc(&kcl_asyncio_bulk_reads);
+        atomic_add(msgs, &kcl_asyncio_bulk_read_msgs);
+    }
+    return done > 0 ? done : ret;
+}
+
+/* Submit one asyncio message per user buffer, stopping at the first error */
+static kcl_ssize_t firegl_asyncio_writev(struct file *filp,
+                                         const struct iovec *iov,
+                                         unsigned long nr_segs,
+                                         kcl_size_t skip,
+                                         kcl_loff_t *off_ptr)
+{
+    kcl_ssize_t done = 0;
+    unsigned long seg;
+    kcl_ssize_t ret = 0;
+
+    for (seg = 0; seg < nr_segs; seg++, skip = 0)
+    {
+        if (iov[seg].iov_len == skip)
+        {
+            continue;
+        }
+
+        ret = firegl_asyncio_write((KCL_IO_FILE_Handle)filp,
+                                   (const char __user *)iov[seg].iov_base + skip,
+                                   iov[seg].iov_len - skip, off_ptr);
+        if (ret <= 0)
+        {
+            break;
+        }
+        done += ret;
+        atomic_inc(&kcl_asyncio_vec_write_msgs);
+    }
+
+    atomic_inc(&kcl_asyncio_vec_writes);
+    return done > 0 ? done : ret;
+}
+
 kcl_ssize_t ip_firegl_read( struct file *filp,
                          char *buf, 
                          kcl_size_t size,
@@ -397,6 +864,71 @@ kcl_ssize_t ip_firegl_write( struct file *filp,
     return ret; 
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+kcl_ssize_t ip_firegl_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    kcl_ssize_t ret;
+
+    /* The core copies with copy_to_user, page vectors cannot be handled */
+    if (to->type & ITER_BVEC)
+    {
+        return -EINVAL;
+    }
+
+    KCL_DEBUG_TRACEIN(FN_FIREGL_READ_WRITE, iov_iter_count(to), NULL);
+    ret = firegl_asyncio_readv(iocb->ki_filp, to->iov, to->nr_segs,
+                               to->iov_offset, &iocb->ki_pos);
+    if (ret > 0)
+    {
+        iov_iter_advance(to, ret);
+    }
+    KCL_DEBUG_TRACEOUT(FN_FIREGL_READ_WRITE, ret, NULL);
+    return ret;
+}
+
+kcl_ssize_t ip_firegl_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    kcl_ssize_t ret;
+
+    if (from->type & ITER_BVEC)
+    {
+        return -EINVAL;
+    }
+
+    KCL_DEBUG_TRACEIN(FN_FIREGL_READ_WRITE, iov_iter_count(from), NULL);
+    ret = firegl_asyncio_writev(iocb->ki_filp, from->iov, from->nr_segs,
+                                from->iov_offset, &iocb->ki_pos);
+    if (ret > 0)
+    {
+        iov_iter_advance(from, ret);
+    }
+    KCL_DEBUG_TRACEOUT(FN_FIREGL_READ_WRITE, ret, NULL);
+    return ret;
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19)
+kcl_ssize_t ip_firegl_aio_read(struct kiocb *iocb, const struct iovec *iov,
+                               unsigned long nr_segs, kcl_loff_t pos)
+{
+    kcl_ssize_t ret;
+
+    KCL_DEBUG_TRACEIN(FN_FIREGL_READ_WRITE, nr_segs, NULL);
+    ret = firegl_asyncio_readv(iocb->ki_filp, iov, nr_segs, 0, &iocb->ki_pos);
+    KCL_DEBUG_TRACEOUT(FN_FIREGL_READ_WRITE, ret, NULL);
+    return ret;
+}
+
+kcl_ssize_t ip_firegl_aio_write(struct kiocb *iocb, const struct iovec *iov,
+                                unsigned long nr_segs, kcl_loff_t pos)
+{
+    kcl_ssize_t ret;
+
+    KCL_DEBUG_TRACEIN(FN_FIREGL_READ_WRITE, nr_segs, NULL);
+    ret = firegl_asyncio_writev(iocb->ki_filp, iov, nr_segs, 0, &iocb->ki_pos);
+    KCL_DEBUG_TRACEOUT(FN_FIREGL_READ_WRITE, ret, NULL);
+    return ret;
+}
+#endif
+
 unsigned int ip_firegl_poll(struct file* filp, struct poll_table_struct* table)
 {
     unsigned  int ret;
@@ -425,8 +957,42 @@ kcl_loff_t ip_firegl_lseek(struct file *filp, kcl_loff_t off, int whence)
     return __KE_ESPIPE; /* unseekable */
 }
 
-static struct semaphore fireglAsyncioSemaphore[FIREGL_ASYNCIO_MAX_SEMA];
-static unsigned char    fireglAsyncioSemaphoreUsed[FIREGL_ASYNCIO_MAX_SEMA];
+/* Asyncio semaphore pool. Semaphores are handed out from chunks of
+ * FIREGL_ASYNCIO_MAX_SEMA entries, each with a bitmap of the used slots.
+ * The first chunk is static. Allocation may run in atomic context, so the
+ * next chunk is added ahead of time from a work item as soon as the last
+ * chunk is taken into use. fireglAsyncioGrowPending keeps that to one
+ * scheduled grow per chunk.
+ */
+#define FIREGL_ASYNCIO_MAX_CHUNKS   16
+
+typedef struct
+{
+    struct semaphore    sema;
+    unsigned int        index;          /* slot in the pool, frees without a search */
+} fireglAsyncioSemaphore_t;
+
+typedef struct
+{
+    unsigned long               used[BITS_TO_LONGS(FIREGL_ASYNCIO_MAX_SEMA)];
+    fireglAsyncioSemaphore_t    sema[FIREGL_ASYNCIO_MAX_SEMA];
+} fireglAsyncioChunk_t;
+
+static fireglAsyncioChunk_t     fireglAsyncioChunk0;
+static fireglAsyncioChunk_t*    fireglAsyncioChunks[FIREGL_ASYNCIO_MAX_CHUNKS] = { &fireglAsyncioChunk0 };
+static unsigned int             fireglAsyncioChunkCount = 1;
+static DEFINE_MUTEX(fireglAsyncioGrowLock);
+static unsigned long            fireglAsyncioGrowPending;
+
+static void firegl_asyncio_grow(struct work_struct* work);
+static DECLARE_WORK(fireglAsyncioGrowWork, firegl_asyncio_grow);
+
+static atomic_t kcl_asyncio_sema_in_use = ATOMIC_INIT(0);
+static atomic_t kcl_asyncio_sema_peak = ATOMIC_INIT(0);
+static atomic_t kcl_asyncio_sema_allocs = ATOMIC_INIT(0);
+static atomic_t kcl_asyncio_sema_failures = ATOMIC_INIT(0);
+
+static void firegl_asyncio_sema_cleanup(void);
 
 static struct file_operations firegl_fops =
 {
@@ -444,6 +1010,13 @@ static struct file_operations firegl_fops =
 
     write:   ip_firegl_write,
     read:    ip_firegl_read,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+    read_iter:  ip_firegl_read_iter,
+    write_iter: ip_firegl_write_iter,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19)
+    aio_read:   ip_firegl_aio_read,
+    aio_write:  ip_firegl_aio_write,
+#endif
     fasync:  ip_firegl_fasync,
     poll:    ip_firegl_poll,
     llseek:  ip_firegl_lseek,
@@ -509,6 +1082,17 @@ typedef struct firegl_drm_stub_info_tag {
 static firegl_drm_stub_info_t firegl_stub_info;
 
 static char *kcl_pte_phys_addr_str(pte_t pte, char *buf, kcl_dma_addr_t* phys_address);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+static int firegl_kcl_stats_proc_read(char *buf, char **start, kcl_off_t offset,
+                                      int request, int* eof, void* data);
+#else
+static int firegl_kcl_stats_proc_read(struct seq_file *m, void* data);
+#endif
+#ifdef FIREGL_IOCTL_STATS
+static int firegl_ioctl_stats_proc_read(struct seq_file *m, void* data);
+static ssize_t firegl_ioctl_stats_proc_write(struct file *file, const char __user *buffer,
+                                             size_t count, loff_t *ppos);
+#endif
 
 #define READ_PROC_WRAP(func)                                            \
 static int func##_wrap(char *buf, char **start, kcl_off_t offset,      \
@@ -619,8 +1203,33 @@ static const struct file_operations firegl_major_fops = {
 		.llseek = seq_lseek,
 };
 
-static int firegl_debug_proc_open(struct inode *inode, struct file *file){
-		return single_open(file, firegl_debug_proc_read_wrap, NULL);
+static int firegl_kcl_stats_proc_open(struct inode *inode, struct file *file){
+		return single_open(file, firegl_kcl_stats_proc_read, NULL);
+}
+
+static const struct file_operations firegl_kcl_stats_fops = {
+		.open = firegl_kcl_stats_proc_open,
+		.read = seq_read,
+		.llseek = seq_lseek,
+		.release = single_release,
+};
+
+#ifdef FIREGL_IOCTL_STATS
+static int firegl_ioctl_stats_proc_open(struct inode *inode, struct file *file){
+		return single_open(file, firegl_ioctl_stats_proc_read, NULL);
+}
+
+static const struct file_operations firegl_ioctl_stats_fops = {
+		.open = firegl_ioctl_stats_proc_open,
+		.read = seq_read,
+		.write = firegl_ioctl_stats_proc_write,
+		.llseek = seq_lseek,
+		.release = single_release,
+};
+#endif
+
+static int firegl_debug_proc_open(struct inode *inode, struct file *file){
+		return single_open(file, firegl_debug_proc_read_wrap, NULL);
 }
 
 static const struct file_operations firegl_debug_fops = {
@@ -747,6 +1356,22 @@ static struct proc_dir_entry *firegl_proc_init( device_t *dev,
             ent->data = dev;
 #endif
         }
+
+        // Global KCL statistics entry
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+        ent = create_proc_entry("kcl_stats", S_IFREG|S_IRUGO, root);
+        if (ent)
+        {
+            ent->read_proc = (read_proc_t*)firegl_kcl_stats_proc_read;
+        }
+#else
+        proc_create("kcl_stats", S_IFREG|S_IRUGO, root, &firegl_kcl_stats_fops);
+#endif
+
+#ifdef FIREGL_IOCTL_STATS
+        // Global ioctl accounting entry
+        proc_create("ioctl_stats", S_IFREG|S_IRUGO|S_IWUSR, root, &firegl_ioctl_stats_fops);
+#endif
     }
 
     return root;
@@ -779,6 +1404,10 @@ static int firegl_proc_cleanup( int minor,
     {
         remove_proc_entry("major", root);
         remove_proc_entry("debug", root);
+        remove_proc_entry("kcl_stats", root);
+#ifdef FIREGL_IOCTL_STATS
+        remove_proc_entry("ioctl_stats", root);
+#endif
 
         remove_proc_entry("ati", NULL);
         KCL_DEBUG1(FN_FIREGL_PROC,"remove /proc/ati. \n");
@@ -1036,7 +1665,21 @@ static struct pci_driver fglrx_pci_driver =
 };
 #endif // FIREGL_POWER_MANAGEMENT
 
+/* Most restrictive DMA mask of all devices. GART pages above it would be
+ * bounced by swiotlb, see kcl_alloc_gart_page. */
+static u64 kcl_gart_dma_mask = ~0ULL;
 
+static atomic_t kcl_gart_dma32_allocs = ATOMIC_INIT(0);
+static atomic_long_t kcl_dma_bytes_above_mask = ATOMIC_LONG_INIT(0);
+
+/* Account a DMA mapping the device cannot reach directly */
+static void kcl_dma_check_mask(struct pci_dev* pdev, u64 phys, unsigned long size)
+{
+    if (pdev->dev.dma_mask && phys + size - 1 > *pdev->dev.dma_mask)
+    {
+        atomic_long_add(size, &kcl_dma_bytes_above_mask);
+    }
+}
 
 
 static int firegl_init_devices(kcl_device_t *pubdev)
@@ -1086,7 +1729,23 @@ static int firegl_init_devices(kcl_device_t *pubdev)
 
 #ifdef FIREGL_DMA_REMAPPING
             //The GART unit of All supported ASICs has 40-bit address range.
-            pci_set_dma_mask(pdev, 0xffffffffffull); 
+            if (pci_set_dma_mask(pdev, 0xffffffffffull) == 0)
+            {
+                pci_set_consistent_dma_mask(pdev, 0xffffffffffull);
+            }
+            kcl_gart_dma_mask = min(kcl_gart_dma_mask, (u64)pdev->dma_mask);
+#else
+            //Bus addresses are physical addresses, only the GART range applies.
+            kcl_gart_dma_mask = min(kcl_gart_dma_mask, 0xffffffffffull);
+#endif
+
+#if defined(__x86_64__) && !defined(ESX)
+            // Small coherent allocations fall back to pci_alloc_consistent
+            // without pools, so a failure here is not fatal.
+            if (KCL_PCI_DmaPoolInit((KCL_PCI_DevHandle)pdev))
+            {
+                KCL_DEBUG_ERROR("Cannot create DMA pools, using coherent allocations only\n");
+            }
 #endif
 
             j++;
@@ -1103,6 +1762,27 @@ static int firegl_init_devices(kcl_device_t *pubdev)
 
 static void firegl_cleanup_devices(void)
 {
+#if defined(__x86_64__) && !defined(ESX)
+    struct pci_dev *pdev;
+    struct pci_device_id *pid;
+    int i;
+
+    for (i=0; fglrx_pci_table[i].vendor != 0; i++)
+    {
+        pid = (struct pci_device_id *) &fglrx_pci_table[i];
+
+        pdev = NULL;
+        while (( pdev = pci_get_subsys(pid->vendor, 
+                                       pid->device, 
+                                       PCI_ANY_ID, 
+                                       PCI_ANY_ID, 
+                                       pdev)) != NULL)
+        {
+            KCL_PCI_DmaPoolCleanup((KCL_PCI_DevHandle)pdev);
+        }
+    }
+#endif
+
     firegl_cleanup_device_heads();
 }
 
@@ -1213,11 +1893,14 @@ static int __init firegl_init_module(void)
     }
 #endif
 
+    kcl_ioctl_stats_init();
+
     // get the minor number
     firegl_minors = firegl_stub_register(dev->pubdev.name, &firegl_fops, dev);
     if (firegl_minors < 1)
     {
         KCL_DEBUG_ERROR("firegl_stub_register failed\n");
+        kcl_ioctl_stats_cleanup();
         kfree(drm_proclist);
         return -EPERM;
     }
@@ -1285,6 +1968,8 @@ static void __exit firegl_cleanup_module(void)
     firegl_kill_32compat_ioctls();
 #endif
 
+    kcl_ioctl_stats_cleanup();
+
     firegl_private_cleanup (&dev->pubdev);
 
     if (drm_proclist)
@@ -1300,6 +1985,8 @@ static void __exit firegl_cleanup_module(void)
     cf_object_cleanup();
     adapter_chain_cleanup();    
 
+    firegl_asyncio_sema_cleanup();
+
     return;
 }
 
@@ -1318,46 +2005,152 @@ int ATI_API_CALL KCL_PM_Is_SuspendToRam(int state)
     }
 }
 
+/* Claim a free slot of the chunk, lock-free. Returns -1 if the chunk is full */
+static int firegl_asyncio_chunk_alloc(fireglAsyncioChunk_t* chunk)
+{
+    unsigned int bit;
+
+    do
+    {
+        bit = find_first_zero_bit(chunk->used, FIREGL_ASYNCIO_MAX_SEMA);
+        if (bit >= FIREGL_ASYNCIO_MAX_SEMA)
+        {
+            return -1;
+        }
+    } while (test_and_set_bit(bit, chunk->used));
+
+    return bit;
+}
+
+static void firegl_asyncio_sema_account(void)
+{
+    int in_use = atomic_inc_return(&kcl_asyncio_sema_in_use);
+    int peak = atomic_read(&kcl_asyncio_sema_peak);
+
+    while (in_use > peak)
+    {
+        int old = atomic_cmpxchg(&kcl_asyncio_sema_peak, peak, in_use);
+        if (old == peak)
+        {
+            break;
+        }
+        peak = old;
+    }
+    atomic_inc(&kcl_asyncio_sema_allocs);
+}
+
+/* Add a chunk to the pool, in process context */
+static void firegl_asyncio_grow(struct work_struct* work)
+{
+    fireglAsyncioChunk_t* chunk;
+
+    mutex_lock(&fireglAsyncioGrowLock);
+    if (fireglAsyncioChunkCount < FIREGL_ASYNCIO_MAX_CHUNKS)
+    {
+        chunk = vmalloc(sizeof(*chunk));
+        if (chunk)
+        {
+            memset(chunk, 0, sizeof(*chunk));
+            fireglAsyncioChunks[fireglAsyncioChunkCount] = chunk;
+            /* Publish the chunk before the count that makes it visible */
+            smp_wmb();
+            fireglAsyncioChunkCount++;
+        }
+    }
+    /* Also cleared on failure, so the next allocation retries */
+    clear_bit(0, &fireglAsyncioGrowPending);
+    mutex_unlock(&fireglAsyncioGrowLock);
+}
+
+/** \brief Allocate an asyncio semaphore
+ *
+ * Safe against concurrent callers and does not sleep. The first
+ * allocation from the last chunk schedules the next chunk, so the pool
+ * normally grows before it runs full.
+ *
+ * \return Pointer to the semaphore, NULL if the pool is exhausted
+ */
 void ATI_API_CALL *KCL_SEMAPHORE_ASYNCIO_Alloc()
 {
-    int i;
-    
-    for(i=0; i<FIREGL_ASYNCIO_MAX_SEMA; i++)
+    fireglAsyncioChunk_t* chunk;
+    unsigned int count;
+    unsigned int i;
+    int bit;
+
+    count = ACCESS_ONCE(fireglAsyncioChunkCount);
+    smp_rmb();
+
+    for (i = 0; i < count; i++)
     {
-        if(fireglAsyncioSemaphoreUsed[i] != 1)
+        chunk = fireglAsyncioChunks[i];
+        bit = firegl_asyncio_chunk_alloc(chunk);
+        if (bit >= 0)
         {
-            fireglAsyncioSemaphoreUsed[i] = 1;
-            
-            return &(fireglAsyncioSemaphore[i]);
+            chunk->sema[bit].index = i * FIREGL_ASYNCIO_MAX_SEMA + bit;
+            firegl_asyncio_sema_account();
+
+            if (i == count - 1 && count < FIREGL_ASYNCIO_MAX_CHUNKS &&
+                !test_and_set_bit(0, &fireglAsyncioGrowPending))
+            {
+                schedule_work(&fireglAsyncioGrowWork);
+            }
+            return &(chunk->sema[bit].sema);
         }
     }
+
+    atomic_inc(&kcl_asyncio_sema_failures);
     return NULL;
 }
 
+/** \brief Free an asyncio semaphore allocated with KCL_SEMAPHORE_ASYNCIO_Alloc */
 void ATI_API_CALL KCL_SEMAPHORE_ASYNCIO_Free(struct semaphore *pSema)
 {
-    int i;
-    
-    for(i=0; i<FIREGL_ASYNCIO_MAX_SEMA; i++)
+    fireglAsyncioSemaphore_t* entry;
+    unsigned int index;
+
+    if (pSema == NULL)
     {
-        if( &(fireglAsyncioSemaphore[i]) == pSema )
-        {
-            fireglAsyncioSemaphoreUsed[i] = 0;
-            return;
-        }
+        return;
+    }
+
+    entry = container_of(pSema, fireglAsyncioSemaphore_t, sema);
+    index = entry->index;
+    if (test_and_clear_bit(index % FIREGL_ASYNCIO_MAX_SEMA,
+                           fireglAsyncioChunks[index / FIREGL_ASYNCIO_MAX_SEMA]->used))
+    {
+        atomic_dec(&kcl_asyncio_sema_in_use);
     }
 }
 
 void ATI_API_CALL KCL_SEMAPHORE_ASYNCIO_Init(void)
 {
-    int i;
+    unsigned int i;
     
-    for(i=0; i<FIREGL_ASYNCIO_MAX_SEMA; i++)
+    /* Keep the chunk count stable against a concurrent grow */
+    mutex_lock(&fireglAsyncioGrowLock);
+    for (i = 0; i < fireglAsyncioChunkCount; i++)
     {
-        fireglAsyncioSemaphoreUsed[i] = 0;
+        bitmap_zero(fireglAsyncioChunks[i]->used, FIREGL_ASYNCIO_MAX_SEMA);
     }
+    mutex_unlock(&fireglAsyncioGrowLock);
+    atomic_set(&kcl_asyncio_sema_in_use, 0);
 }    
 
+static void firegl_asyncio_sema_cleanup(void)
+{
+    unsigned int i;
+
+    cancel_work_sync(&fireglAsyncioGrowWork);
+
+    for (i = 1; i < fireglAsyncioChunkCount; i++)
+    {
+        vfree(fireglAsyncioChunks[i]);
+        fireglAsyncioChunks[i] = NULL;
+    }
+    fireglAsyncioChunkCount = 1;
+    clear_bit(0, &fireglAsyncioGrowPending);
+}
+
 int ATI_API_CALL KCL_SYSINFO_MapConstant(int constant)
 {
     switch (constant)
@@ -1381,35 +2174,102 @@ int ATI_API_CALL KCL_SYSINFO_MapConstant(int constant)
     }
 }
 
+/** \brief Resolve the memory type actually applied for a page cache request
+ *
+ * Write combining is only available when PAT is enabled, otherwise the
+ * request is downgraded to uncached, which is what the caller got before
+ * WC support was added.
+ *
+ *  \param type Requested memory type, one of KCL_ENUM_PageCacheType.
+ *  \return Memory type to be applied.
+ */
+static int kcl_page_cache_type(int type)
+{
+    if (type == KCL_PAGE_CACHE_WC)
+    {
+#if defined(FIREGL_USWC_SUPPORT) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+        if (kcl_mem_pat_status != KCL_MEM_PAT_DISABLED)
+        {
+            return KCL_PAGE_CACHE_WC;
+        }
+#endif
+        return KCL_PAGE_CACHE_UC;
+    }
+
+    return type ? KCL_PAGE_CACHE_WB : KCL_PAGE_CACHE_UC;
+}
+
 /** \brief Change page attribute of continuous pages 
  *  \param pt Kernel virtual address of the start page.
  *  \param pages Number of pages to change.
- *  \param enable Memory type to be set. Writeback:1. Uncached:0.
+ *  \param enable Memory type to be set. Writeback:1. Uncached:0. Write-combined:2.
  *  \return kernel defined error code.
  */
 int ATI_API_CALL KCL_SetPageCache(void* pt, int pages, int enable)
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
     unsigned long prot=KCL_GetInitKerPte((unsigned long)pt) & pgprot_val(PAGE_KERNEL) ;  //PCD been cleared and keep NX setting.
-    if(!enable)
+    if(kcl_page_cache_type(enable) != KCL_PAGE_CACHE_WB)
         prot |= 1 <<_PAGE_BIT_PCD;
     return change_page_attr(virt_to_page(pt), pages, __pgprot(prot));
 #else
-    if (enable)
+    switch (kcl_page_cache_type(enable))
     {
-        return set_memory_wb((unsigned long)pt, pages);
+        case KCL_PAGE_CACHE_WB:
+            return set_memory_wb((unsigned long)pt, pages);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+        case KCL_PAGE_CACHE_WC:
+            return set_memory_wc((unsigned long)pt, pages);
+#endif
+        default:
+            return set_memory_uc((unsigned long)pt, pages);
     }
-    else
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+/** \brief Change page attribute of a list of kernel virtual addresses
+ *  \param addr Array of lowmem kernel virtual page addresses.
+ *  \param count Number of entries in the array.
+ *  \param type Memory type as returned by kcl_page_cache_type.
+ *  \return kernel defined error code.
+ */
+static int kcl_set_memory_array(unsigned long *addr, unsigned int count, int type)
+{
+    int ret = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
+    unsigned int i;
+#endif
+
+    switch (type)
     {
-        return set_memory_uc((unsigned long)pt, pages);
-    }
+        case KCL_PAGE_CACHE_WB:
+            ret = set_memory_array_wb(addr, count);
+            break;
+        case KCL_PAGE_CACHE_WC:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+            ret = set_memory_array_wc(addr, count);
+#else
+            /* No array variant for WC, convert page by page */
+            for (i = 0; (i < count) && !ret; i++)
+            {
+                ret = set_memory_wc(addr[i], 1);
+            }
 #endif
+            break;
+        default:
+            ret = set_memory_array_uc(addr, count);
+            break;
+    }
+
+    return ret;
 }
+#endif
 
 /** \brief Change page attribute of a page array 
  *  \param pt Pointer to the array. Each element in the array contains a pointer of a page structure.
  *  \param pages Number of pages to change.
- *  \param enable Memory type to be set. Writeback:1. Uncached:0.
+ *  \param enable Memory type to be set. Writeback:1. Uncached:0. Write-combined:2.
  *  \return kernel defined error code.
  */
 int ATI_API_CALL KCL_SetPageCache_Array(unsigned long *pt, int pages, int enable)
@@ -1431,14 +2291,7 @@ int ATI_API_CALL KCL_SetPageCache_Array(unsigned long *pt, int pages, int enable
             pPageList[lowPageCount++] = (unsigned long )KCL_ConvertPageToKernelAddress((void*)pt[i]);
         }
     }
-    if (enable)
-    {
-        ret = set_memory_array_wb(pPageList, lowPageCount);
-    }   
-    else                
-    {                
-        ret = set_memory_array_uc(pPageList, lowPageCount);
-    }
+    ret = kcl_set_memory_array(pPageList, lowPageCount, kcl_page_cache_type(enable));
     if (pPageList != NULL)
     {
         kfree(pPageList);
@@ -1469,89 +2322,389 @@ int ATI_API_CALL KCL_SetPageCache_Array(unsigned long *pt, int pages, int enable
 }
 
 
-/** \brief Check whether the page is located within the high memory zone
- *  \return Nonzero if page is in high memory zone, zero otherwise
+/* Page attribute change batching.
+ *
+ * Every KCL_SetPageCache_Array call makes one set_memory_array_* call and
+ * one KCL_PageCache_Flush. A batch collects the pages of many such requests
+ * in request order, merging consecutive requests of the same memory type
+ * into one run. At commit time every run is applied with one attribute
+ * change, in request order so that a page queued twice ends up with the
+ * type requested last, followed by a single KCL_PageCache_Flush.
  */
-unsigned int ATI_API_CALL KCL_IsPageInHighMem(void* page)
-{
-   return PageHighMem((struct page*)page);
-}
+#define KCL_PAGE_CACHE_BATCH_MIN    64
 
+typedef struct
+{
+    int             type;       /* memory type as returned by kcl_page_cache_type */
+    unsigned int    first;      /* index of the first address of the run */
+    unsigned int    count;
+} kcl_page_cache_run_t;
 
-/** /brief Call global kernel task/thread scheduler */
-void ATI_API_CALL KCL_GlobalKernelScheduler(void)
+typedef struct kcl_page_cache_batch_tag
 {
-	schedule();
-}
+    unsigned long*          addr;       /* lowmem kernel addresses */
+    unsigned int            count;
+    unsigned int            size;
+    kcl_page_cache_run_t*   runs;
+    unsigned int            run_count;
+    unsigned int            run_size;
+    unsigned int            requests;   /* number of Add calls */
+} kcl_page_cache_batch_t;
 
-/** /brief Check whether the current process is being terminated
- *  /return Nonzero if process is being terminated, zero otherwise
+static atomic_t kcl_page_cache_batch_commits = ATOMIC_INIT(0);
+static atomic_t kcl_page_cache_attr_calls_avoided = ATOMIC_INIT(0);
+
+/** \brief Make room for more elements in a growable batch array
+ *  \param array Array to grow, reallocated if needed.
+ *  \param size Allocated number of elements, updated on growth.
+ *  \param count Number of elements in use.
+ *  \param more Number of elements about to be added.
+ *  \param elem Size of one element.
+ *  \return 0 on success, -ENOMEM otherwise.
  */
-unsigned int ATI_API_CALL KCL_CurrentProcessIsTerminating(void)
+static int kcl_page_cache_batch_reserve(void** array,
+                                        unsigned int* size,
+                                        unsigned int count,
+                                        unsigned int more,
+                                        size_t elem)
 {
-   return ( current->flags & PF_EXITING ? 1 : 0 );
+    void* p;
+    unsigned int n;
+
+    if (count + more <= *size)
+    {
+        return 0;
+    }
+
+    n = max(*size * 2, count + more);
+    n = max(n, (unsigned int)KCL_PAGE_CACHE_BATCH_MIN);
+
+    p = kmalloc(n * elem, GFP_KERNEL);
+    if (p == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    if (*array != NULL)
+    {
+        memcpy(p, *array, count * elem);
+        kfree(*array);
+    }
+
+    *array = p;
+    *size = n;
+
+    return 0;
 }
 
-/** /brief Call global OS kernel task/thread scheduler 
- *  /return Nonzero if a system call was awakened by a signal
+/** \brief Reserve room for a request in a page attribute batch
+ *  \param batch Batch handle.
+ *  \param pages Number of addresses about to be added.
+ *  \return 0 on success, -ENOMEM otherwise.
  */
-int ATI_API_CALL KCL_GetSignalStatus(void)
+static int kcl_page_cache_batch_prepare(kcl_page_cache_batch_t* batch, unsigned int pages)
 {
-    return signal_pending(current);
+    if (kcl_page_cache_batch_reserve((void**)&batch->addr, &batch->size,
+                                     batch->count, pages, sizeof(*batch->addr)) ||
+        kcl_page_cache_batch_reserve((void**)&batch->runs, &batch->run_size,
+                                     batch->run_count, 1, sizeof(*batch->runs)))
+    {
+        KCL_DEBUG_ERROR("Out of memory when growing page cache batch\n");
+        return -ENOMEM;
+    }
+
+    return 0;
 }
 
-/** /brief Vector of OS dependent values of security caps indexed by KCL_ENUM_ProcessState */
-static int KCL_MAP_ProcessState[] =
+/** \brief Account the addresses queued by a request to its run
+ *  \param batch Batch handle.
+ *  \param type Memory type of the request.
+ *  \param first Index of the first address queued by the request.
+ */
+static void kcl_page_cache_batch_close(kcl_page_cache_batch_t* batch, int type, unsigned int first)
 {
-    TASK_RUNNING,           // KCL_PROCESS_STATE_READY_TO_RUN
-    TASK_UNINTERRUPTIBLE,   // KCL_PROCESS_STATE_UNINTERRUPTIBLE_SLEEP
-    TASK_INTERRUPTIBLE      // KCL_PROCESS_STATE_INTERRUPTIBLE_SLEEP
-};
+    kcl_page_cache_run_t* run;
 
-/** \brief Set current process state
- *  \param state OS independent process state
+    batch->requests++;
+
+    if (batch->count == first)
+    {
+        return;
+    }
+
+    run = batch->run_count ? &batch->runs[batch->run_count - 1] : NULL;
+    if (run == NULL || run->type != type)
+    {
+        run = &batch->runs[batch->run_count++];
+        run->type = type;
+        run->first = first;
+        run->count = 0;
+    }
+
+    run->count += batch->count - first;
+}
+
+/** \brief Release a page attribute batch without applying it
+ *  \param batch Batch handle returned by KCL_PageCacheBatch_Begin.
  */
-void ATI_API_CALL KCL_SetCurrentProcessState(KCL_ENUM_ProcessState state)
+void ATI_API_CALL KCL_PageCacheBatch_Abort(void* batch)
 {
-    if (state >= KCL_PROCESS_STATE_NUM)
+    kcl_page_cache_batch_t* b = (kcl_page_cache_batch_t*)batch;
+
+    if (b == NULL)
     {
         return;
     }
 
-    current->state = KCL_MAP_ProcessState[state];
-}
+    if (b->addr != NULL)
+    {
+        kfree(b->addr);
+    }
 
-#if defined(__i386__) 
-#ifndef __HAVE_ARCH_CMPXCHG
-static inline 
-unsigned long __fgl_cmpxchg(volatile void *ptr, unsigned long old,            
-                        unsigned long new, int size)                      
-{                                                                                       
-    unsigned long prev;                                                             
-    switch (size) {                                                                 
-    case 1:                                                                         
-        __asm__ __volatile__(LOCK_PREFIX "cmpxchgb %b1,%2"
-                             : "=a"(prev)
-                             : "q"(new), "m"(*__xg(ptr)), "0"(old)
-                             : "memory");
-        return prev;
-    case 2:
-        __asm__ __volatile__(LOCK_PREFIX "cmpxchgw %w1,%2"
-                             : "=a"(prev)
-                             : "q"(new), "m"(*__xg(ptr)), "0"(old)
-                             : "memory");
-        return prev;
-    case 4:
-        __asm__ __volatile__(LOCK_PREFIX "cmpxchgl %1,%2"
-                             : "=a"(prev)
-                             : "q"(new), "m"(*__xg(ptr)), "0"(old)
-                             : "memory");
-        return prev;
+    if (b->runs != NULL)
+    {
+        kfree(b->runs);
     }
-    return old;
+
+    kfree(b);
 }
-#endif /* cmpxchg */
-#elif defined(__alpha__)
+
+/** \brief Start a batch of page attribute changes
+ *  \return Batch handle, NULL if out of memory.
+ */
+void* ATI_API_CALL KCL_PageCacheBatch_Begin(void)
+{
+    kcl_page_cache_batch_t* batch;
+
+    batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+    if (batch == NULL)
+    {
+        KCL_DEBUG_ERROR("Out of memory when allocating page cache batch\n");
+        return NULL;
+    }
+
+    memset(batch, 0, sizeof(*batch));
+
+    return batch;
+}
+
+/** \brief Queue the attribute change of a page array
+ *
+ * Same semantics as KCL_SetPageCache_Array, the change takes effect at
+ * KCL_PageCacheBatch_Commit.
+ *
+ *  \param batch Batch handle returned by KCL_PageCacheBatch_Begin.
+ *  \param pt Pointer to the array. Each element in the array contains a pointer of a page structure.
+ *  \param pages Number of pages to change.
+ *  \param enable Memory type to be set. Writeback:1. Uncached:0. Write-combined:2.
+ *  \return 0 on success, kernel defined error code otherwise.
+ */
+int ATI_API_CALL KCL_PageCacheBatch_Add(void* batch, unsigned long *pt, int pages, int enable)
+{
+    kcl_page_cache_batch_t* b = (kcl_page_cache_batch_t*)batch;
+    unsigned int first;
+    int i;
+
+    if (b == NULL || pages < 0)
+    {
+        return -EINVAL;
+    }
+
+    if (kcl_page_cache_batch_prepare(b, pages))
+    {
+        return -ENOMEM;
+    }
+
+    first = b->count;
+    for (i = 0; i < pages; i++)
+    {
+        if (!KCL_IsPageInHighMem((void *)pt[i]))
+        {
+            b->addr[b->count++] = (unsigned long)KCL_ConvertPageToKernelAddress((void *)pt[i]);
+        }
+    }
+
+    kcl_page_cache_batch_close(b, kcl_page_cache_type(enable), first);
+
+    return 0;
+}
+
+/** \brief Queue the attribute change of continuous pages
+ *
+ * Same semantics as KCL_SetPageCache, the change takes effect at
+ * KCL_PageCacheBatch_Commit.
+ *
+ *  \param batch Batch handle returned by KCL_PageCacheBatch_Begin.
+ *  \param virt Kernel virtual address of the start page.
+ *  \param pages Number of pages to change.
+ *  \param enable Memory type to be set. Writeback:1. Uncached:0. Write-combined:2.
+ *  \return 0 on success, kernel defined error code otherwise.
+ */
+int ATI_API_CALL KCL_PageCacheBatch_AddRange(void* batch, void* virt, int pages, int enable)
+{
+    kcl_page_cache_batch_t* b = (kcl_page_cache_batch_t*)batch;
+    unsigned int first;
+    int i;
+
+    if (b == NULL || pages < 0)
+    {
+        return -EINVAL;
+    }
+
+    if (kcl_page_cache_batch_prepare(b, pages))
+    {
+        return -ENOMEM;
+    }
+
+    first = b->count;
+    for (i = 0; i < pages; i++)
+    {
+        b->addr[b->count++] = (unsigned long)virt + i * PAGE_SIZE;
+    }
+
+    kcl_page_cache_batch_close(b, kcl_page_cache_type(enable), first);
+
+    return 0;
+}
+
+/** \brief Apply all queued page attribute changes and release the batch
+ *
+ * The queued runs are applied in request order with one attribute change
+ * each, and a single KCL_PageCache_Flush is done for the batch.
+ *
+ *  \param batch Batch handle returned by KCL_PageCacheBatch_Begin.
+ *  \return kernel defined error code of the first failing change, 0 on success.
+ */
+int ATI_API_CALL KCL_PageCacheBatch_Commit(void* batch)
+{
+    kcl_page_cache_batch_t* b = (kcl_page_cache_batch_t*)batch;
+    kcl_page_cache_run_t* run;
+    unsigned int r;
+    int err;
+    int ret = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,28)
+    unsigned int i;
+#endif
+
+    if (b == NULL)
+    {
+        return -EINVAL;
+    }
+
+    for (r = 0, run = b->runs; r < b->run_count; r++, run++)
+    {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+        err = kcl_set_memory_array(b->addr + run->first, run->count, run->type);
+#else
+        for (i = 0, err = 0; (i < run->count) && !err; i++)
+        {
+            err = KCL_SetPageCache((void *)b->addr[run->first + i], 1, run->type);
+        }
+#endif
+        if (err && !ret)
+        {
+            ret = err;
+        }
+    }
+
+    if (b->requests)
+    {
+        /* See KCL_SetPageCache_Array for why the flush is needed */
+        KCL_PageCache_Flush();
+
+        atomic_inc(&kcl_page_cache_batch_commits);
+        /* Unbatched, every request makes one attribute change call */
+        atomic_add(b->requests - b->run_count, &kcl_page_cache_attr_calls_avoided);
+    }
+
+    KCL_PageCacheBatch_Abort(b);
+
+    return ret;
+}
+
+/** \brief Check whether the page is located within the high memory zone
+ *  \return Nonzero if page is in high memory zone, zero otherwise
+ */
+unsigned int ATI_API_CALL KCL_IsPageInHighMem(void* page)
+{
+   return PageHighMem((struct page*)page);
+}
+
+
+/** /brief Call global kernel task/thread scheduler */
+void ATI_API_CALL KCL_GlobalKernelScheduler(void)
+{
+	schedule();
+}
+
+/** /brief Check whether the current process is being terminated
+ *  /return Nonzero if process is being terminated, zero otherwise
+ */
+unsigned int ATI_API_CALL KCL_CurrentProcessIsTerminating(void)
+{
+   return ( current->flags & PF_EXITING ? 1 : 0 );
+}
+
+/** /brief Call global OS kernel task/thread scheduler 
+ *  /return Nonzero if a system call was awakened by a signal
+ */
+int ATI_API_CALL KCL_GetSignalStatus(void)
+{
+    return signal_pending(current);
+}
+
+/** /brief Vector of OS dependent values of security caps indexed by KCL_ENUM_ProcessState */
+static int KCL_MAP_ProcessState[] =
+{
+    TASK_RUNNING,           // KCL_PROCESS_STATE_READY_TO_RUN
+    TASK_UNINTERRUPTIBLE,   // KCL_PROCESS_STATE_UNINTERRUPTIBLE_SLEEP
+    TASK_INTERRUPTIBLE      // KCL_PROCESS_STATE_INTERRUPTIBLE_SLEEP
+};
+
+/** \brief Set current process state
+ *  \param state OS independent process state
+ */
+void ATI_API_CALL KCL_SetCurrentProcessState(KCL_ENUM_ProcessState state)
+{
+    if (state >= KCL_PROCESS_STATE_NUM)
+    {
+        return;
+    }
+
+    current->state = KCL_MAP_ProcessState[state];
+}
+
+#if defined(__i386__) 
+#ifndef __HAVE_ARCH_CMPXCHG
+static inline 
+unsigned long __fgl_cmpxchg(volatile void *ptr, unsigned long old,            
+                        unsigned long new, int size)                      
+{                                                                                       
+    unsigned long prev;                                                             
+    switch (size) {                                                                 
+    case 1:                                                                         
+        __asm__ __volatile__(LOCK_PREFIX "cmpxchgb %b1,%2"
+                             : "=a"(prev)
+                             : "q"(new), "m"(*__xg(ptr)), "0"(old)
+                             : "memory");
+        return prev;
+    case 2:
+        __asm__ __volatile__(LOCK_PREFIX "cmpxchgw %w1,%2"
+                             : "=a"(prev)
+                             : "q"(new), "m"(*__xg(ptr)), "0"(old)
+                             : "memory");
+        return prev;
+    case 4:
+        __asm__ __volatile__(LOCK_PREFIX "cmpxchgl %1,%2"
+                             : "=a"(prev)
+                             : "q"(new), "m"(*__xg(ptr)), "0"(old)
+                             : "memory");
+        return prev;
+    }
+    return old;
+}
+#endif /* cmpxchg */
+#elif defined(__alpha__)
 todo !!!
 #endif
 
@@ -1700,6 +2853,7 @@ unsigned long ATI_API_CALL KCL_ConvertAddressVirtualToPhysical(void* address)
 
 unsigned long long ATI_API_CALL KCL_MapVirtualToPhysical(KCL_PCI_DevHandle pdev, void* address, unsigned long size)
 {
+    kcl_dma_check_mask((struct pci_dev*)pdev, virt_to_phys(address), size);
 #ifdef FIREGL_DMA_REMAPPING    
     return (unsigned long long)pci_map_single(pdev, address, size, PCI_DMA_BIDIRECTIONAL);
 #else
@@ -1723,6 +2877,9 @@ unsigned long ATI_API_CALL KCL_MapPageToPfn(KCL_PCI_DevHandle pdev, void* page)
     unsigned long page_index;
 #ifdef FIREGL_DMA_REMAPPING    
     dma_addr_t bus_addr;
+#endif
+    kcl_dma_check_mask((struct pci_dev*)pdev, page_to_phys((struct page*)page), PAGE_SIZE);
+#ifdef FIREGL_DMA_REMAPPING    
     bus_addr = pci_map_page ((struct pci_dev*)pdev, (struct page*)page, 0, PAGE_SIZE, PCI_DMA_BIDIRECTIONAL);
     page_index = (bus_addr >> PAGE_SHIFT);
 #else
@@ -1738,6 +2895,161 @@ void ATI_API_CALL KCL_UnmapPageToPfn(KCL_PCI_DevHandle pdev, unsigned long long
 #endif
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+static atomic_t kcl_sg_maps = ATOMIC_INIT(0);
+static atomic_t kcl_sg_pages = ATOMIC_INIT(0);
+static atomic_t kcl_sg_segments = ATOMIC_INIT(0);
+#endif
+
+/** \brief Map a page list for DMA as a scatter-gather table
+ *
+ * Physically contiguous runs of the list are merged into one segment, up to
+ * the maximum segment size of the device, and the table is mapped with a
+ * single pci_map_sg call. Large buffers then take a few segments and IOMMU
+ * mappings instead of one per page.
+ *
+ *  \param pdev       PCI device the pages are mapped for
+ *  \param page_list  pages to map
+ *  \param page_cnt   number of pages
+ *  \param seg_cnt    number of DMA segments [out]
+ *  \return handle of the mapping, NULL on failure
+ */
+void* ATI_API_CALL KCL_MapPageListToSg(KCL_PCI_DevHandle pdev, void** page_list, unsigned int page_cnt, unsigned int* seg_cnt)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+    struct pci_dev* dev = (struct pci_dev*)pdev;
+    unsigned int max_seg = dma_get_max_seg_size(&dev->dev);
+    struct sg_table* table;
+    struct scatterlist* sg;
+    unsigned int nents = 0;
+    unsigned int i, run, seg;
+    int ret;
+
+    if (page_cnt == 0)
+    {
+        return NULL;
+    }
+
+    /* Count the contiguous runs first, so the table is sized exactly */
+    for (i = 0, run = max_seg; i < page_cnt; i++)
+    {
+        if (i == 0 || run + PAGE_SIZE > max_seg ||
+            page_to_pfn((struct page*)page_list[i]) != page_to_pfn((struct page*)page_list[i - 1]) + 1)
+        {
+            nents++;
+            run = 0;
+        }
+        run += PAGE_SIZE;
+    }
+
+    table = kmalloc(sizeof(*table), GFP_KERNEL);
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    if (sg_alloc_table(table, nents, GFP_KERNEL))
+    {
+        kfree(table);
+        return NULL;
+    }
+
+    sg = NULL;
+    for (i = 0, run = max_seg; i < page_cnt; i++)
+    {
+        if (i == 0 || run + PAGE_SIZE > max_seg ||
+            page_to_pfn((struct page*)page_list[i]) != page_to_pfn((struct page*)page_list[i - 1]) + 1)
+        {
+            sg = sg ? sg_next(sg) : table->sgl;
+            sg_set_page(sg, (struct page*)page_list[i], PAGE_SIZE, 0);
+            run = 0;
+        }
+        else
+        {
+            sg->length += PAGE_SIZE;
+        }
+        run += PAGE_SIZE;
+    }
+
+    for_each_sg(table->sgl, sg, table->orig_nents, seg)
+    {
+        kcl_dma_check_mask(dev, sg_phys(sg), sg->length);
+    }
+
+#ifdef FIREGL_DMA_REMAPPING
+    ret = pci_map_sg(dev, table->sgl, table->orig_nents, PCI_DMA_BIDIRECTIONAL);
+    if (ret == 0)
+    {
+        sg_free_table(table);
+        kfree(table);
+        return NULL;
+    }
+    table->nents = ret;
+#else
+    /* Same as KCL_MapPageToPfn, the bus address is the physical address */
+    for_each_sg(table->sgl, sg, table->orig_nents, seg)
+    {
+        sg_dma_address(sg) = sg_phys(sg);
+        sg_dma_len(sg) = sg->length;
+    }
+#endif
+
+    atomic_inc(&kcl_sg_maps);
+    atomic_add(page_cnt, &kcl_sg_pages);
+    atomic_add(table->nents, &kcl_sg_segments);
+
+    *seg_cnt = table->nents;
+    return table;
+#else
+    return NULL;
+#endif
+}
+
+/** \brief Get the DMA segments of a scatter-gather mapping
+ *  \param handle     mapping returned by KCL_MapPageListToSg
+ *  \param bus_addr   bus address of each segment [out]
+ *  \param length     length of each segment in bytes [out]
+ *  \param seg_cnt    size of the output arrays
+ *  \return number of segments stored
+ */
+unsigned int ATI_API_CALL KCL_GetSgSegments(void* handle, unsigned long long* bus_addr, unsigned int* length, unsigned int seg_cnt)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+    struct sg_table* table = (struct sg_table*)handle;
+    struct scatterlist* sg;
+    unsigned int i;
+
+    seg_cnt = min(seg_cnt, table->nents);
+
+    for_each_sg(table->sgl, sg, seg_cnt, i)
+    {
+        bus_addr[i] = sg_dma_address(sg);
+        length[i] = sg_dma_len(sg);
+    }
+
+    return seg_cnt;
+#else
+    return 0;
+#endif
+}
+
+/** \brief Unmap and free a scatter-gather mapping
+ *  \param pdev    PCI device the pages were mapped for
+ *  \param handle  mapping returned by KCL_MapPageListToSg
+ */
+void ATI_API_CALL KCL_UnmapSg(KCL_PCI_DevHandle pdev, void* handle)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+    struct sg_table* table = (struct sg_table*)handle;
+
+#ifdef FIREGL_DMA_REMAPPING
+    pci_unmap_sg((struct pci_dev*)pdev, table->sgl, table->orig_nents, PCI_DMA_BIDIRECTIONAL);
+#endif
+    sg_free_table(table);
+    kfree(table);
+#endif
+}
+
 /** \brief Convert a page to kernel virtual address 
  *  \param page pointer to page
  *  \return kernel virtual address
@@ -2109,14 +3421,76 @@ int ATI_API_CALL KCL_CopyToUserSpace(void __user * to, const void* from, kcl_siz
     return copy_to_user(to, from, size);
 }
 
-void* ATI_API_CALL KCL_MEM_SmallBufferAlloc(kcl_size_t size)
-{
-    return kmalloc(size, GFP_KERNEL);
-}
+/* Copied in one go between rescheduling points */
+#define KCL_USER_WC_CHUNK_SIZE  (64 * 1024)
 
-void* ATI_API_CALL KCL_MEM_SmallBufferAllocAtomic(kcl_size_t size)
+static atomic_long_t kcl_user_wc_bytes = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_user_wc_us = ATOMIC_LONG_INIT(0);
+
+/** \brief Copy data from user space directly to a write-combined destination
+ * Has to be called in user context
+ * May sleep
+ *
+ * Streams from the user buffer to the destination with non-temporal stores,
+ * instead of a copy into kernel memory followed by a second copy. The copy
+ * stops at the first byte that cannot be read.
+ *
+ *  \param to Pointer to the WC destination in kernel space
+ *  \param from Pointer to source in user space
+ *  \param size Number of bytes to copy
+ *  \return Zero on success, number of bytes not copied otherwise
+ */
+unsigned long ATI_API_CALL KCL_CopyFromUserToWC(void* to, const void __user * from, kcl_size_t size)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+    char* dst = (char*)to;
+    const char __user* src = (const char __user*)from;
+    unsigned long left = size;
+    unsigned long n, rest;
+    ktime_t start;
+
+    if (!access_ok(VERIFY_READ, from, size))
+    {
+        return size;
+    }
+
+    start = ktime_get();
+
+    while (left)
+    {
+        n = min(left, (unsigned long)KCL_USER_WC_CHUNK_SIZE);
+#if defined(__i386__) || defined(__x86_64__)
+        rest = __copy_from_user_nocache(dst, src, n);
+#else
+        rest = __copy_from_user(dst, src, n);
+#endif
+        /* The copy already went as far as the source is readable */
+        if (rest)
+        {
+            left -= n - rest;
+            break;
+        }
+
+        dst += n;
+        src += n;
+        left -= n;
+
+        cond_resched();
+    }
+
+    atomic_long_add(size - left, &kcl_user_wc_bytes);
+    atomic_long_add((long)ktime_to_us(ktime_sub(ktime_get(), start)), &kcl_user_wc_us);
+
+    return left;
+}
+
+void* ATI_API_CALL KCL_MEM_SmallBufferAlloc(kcl_size_t size)
+{
+    return kmalloc(size, GFP_KERNEL);
+}
+
+void* ATI_API_CALL KCL_MEM_SmallBufferAllocAtomic(kcl_size_t size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
     /* atomic kmalloc would easily fall back to slowpath
      * because without sleep. Check order earlier can
      * avoid warning back trace printed by slowpath.
@@ -2149,14 +3523,54 @@ void ATI_API_CALL KCL_MEM_Free(void* p)
     return vfree(p);
 }
 
+/* Some device can only reach the low 4GB */
+static __inline__ int kcl_gart_dma32_only(void)
+{
+    return kcl_gart_dma_mask <= 0xffffffffull;
+}
+
+/* GFP flags for GART pages that must sit below 4GB */
+static __inline__ gfp_t kcl_gart_gfp_dma32(void)
+{
+#ifdef CONFIG_ZONE_DMA32
+    return GFP_KERNEL | GFP_DMA32;
+#else
+    return GFP_KERNEL;
+#endif
+}
+
+/* Allocate a GART page the devices can reach without bouncing. With a
+ * 32-bit mask the page comes from below 4GB directly. Otherwise it comes
+ * from anywhere, and only an allocation that lands above the mask is
+ * retried below 4GB. */
+static struct page* kcl_alloc_gart_page(gfp_t flags)
+{
+    struct page* page;
+
+    if (!kcl_gart_dma32_only())
+    {
+        page = alloc_page(GFP_KERNEL | __GFP_HIGHMEM | flags);
+        if (page == NULL || page_to_phys(page) + PAGE_SIZE - 1 <= kcl_gart_dma_mask)
+        {
+            return page;
+        }
+
+        __free_page(page);
+    }
+
+    atomic_inc(&kcl_gart_dma32_allocs);
+    return alloc_page(kcl_gart_gfp_dma32() | flags);
+}
+
 /** \brief Allocate page for gart usage
- *  Try to allocated the page from high memory first, if failed than use low memory
+ *  Try to allocated the page from high memory first, if failed than use low memory.
+ *  The page is below the DMA mask of all devices.
  *  Note: this page not been mapped.
  *  \return pointer to a page
 */ 
 void* ATI_API_CALL KCL_MEM_AllocPageForGart(void)
 {
-    return (void*)alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+    return (void*)kcl_alloc_gart_page(0);
 }
 
 /** \brief free the page that originally allocated for gart usage
@@ -3298,6 +4712,86 @@ void ATI_API_CALL KCL_DisableMSI(void* context)
 
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+/** \brief Check whether a page can be inserted by PFN with the VMA cache type
+ *
+ * With PAT, vm_insert_mixed maps RAM with the memory type of the page, which
+ * is that of its linear mapping, and not with vm_page_prot. A WC or UC
+ * request for a page still cached in the linear mapping would silently
+ * become WB.
+ *
+ * \param vma   faulting VMA [in]
+ * \param page  page backing the faulting address [in]
+ *
+ * \return nonzero if the PFN is mapped with the cache type of vm_page_prot
+ */
+static int kcl_vm_pfn_cache_matches(struct vm_area_struct *vma, struct page* page)
+{
+#ifdef CONFIG_X86_PAT
+    unsigned long cache_mask = _PAGE_PWT | _PAGE_PCD;
+    unsigned long want = pgprot_val(vma->vm_page_prot) & cache_mask;
+    unsigned int level;
+    pte_t* pte;
+
+    if (want == 0)
+    {
+        return 1;
+    }
+
+    /* Highmem pages have no linear mapping and are always WB */
+    if (PageHighMem(page))
+    {
+        return 0;
+    }
+
+    pte = lookup_address((unsigned long)page_address(page), &level);
+
+    return pte && (pte_flags(*pte) & cache_mask) == want;
+#else
+    return 1;
+#endif
+}
+
+/** \brief Hand a resolved page back to the fault path
+ *
+ * Mappings created by KCL_MEM_VM_MapRegionPfn are VM_MIXEDMAP. Their pages
+ * are owned by the driver for the lifetime of the mapping, so the PFN is
+ * inserted directly and neither the fault nor the unmap touch the page
+ * reference count. Other mappings, and pages whose linear mapping does not
+ * have the cache type of the mapping (see kcl_vm_pfn_cache_matches), return
+ * the referenced page as before, which maps it with vm_page_prot.
+ *
+ * \param vma   faulting VMA [in]
+ * \param vmf   fault descriptor [in]
+ * \param page  page backing the faulting address [in]
+ *
+ * \return fault handler return code
+ */
+static int kcl_vm_fault_map_page(struct vm_area_struct *vma, struct vm_fault *vmf, struct page* page)
+{
+    int ret;
+
+    if (!(vma->vm_flags & VM_MIXEDMAP) || !kcl_vm_pfn_cache_matches(vma, page))
+    {
+        KCL_MEM_IncPageCount_Mapping(page);
+        vmf->page = page;
+        return (0);
+    }
+
+    ret = vm_insert_mixed(vma, (unsigned long)vmf->virtual_address, page_to_pfn(page));
+    switch (ret)
+    {
+        case 0:
+        case -EBUSY:    /* raced with another fault on the same address */
+            return VM_FAULT_NOPAGE;
+        case -ENOMEM:
+            return VM_FAULT_OOM;
+        default:
+            return (PAGING_FAULT_SIGBUS);
+    }
+}
+#endif
+
 typedef struct page mem_map_t;
 typedef mem_map_t *vm_nopage_ret_t;
 
@@ -3420,16 +4914,13 @@ static __inline__ int do_vm_dma_fault(struct vm_area_struct *vma, struct vm_faul
 
     pMmPage = virt_to_page(kaddr);
 
-    KCL_MEM_IncPageCount_Mapping(pMmPage);
-
     KCL_DEBUG3(FN_DRM_NOPAGE, "vm-address 0x%08lx => kernel-page-address 0x%p\n",
         address, page_address(pMmPage));
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+    KCL_MEM_IncPageCount_Mapping(pMmPage);
     return pMmPage;
 #else
-    vmf->page = pMmPage;
-
-    return (0);
+    return kcl_vm_fault_map_page(vma, vmf, pMmPage);
 #endif
 }
 
@@ -3452,12 +4943,11 @@ static __inline__ int do_vm_kmap_fault(struct vm_area_struct *vma, struct vm_fau
 
     if ((pMmPage = (mem_map_t*) firegl_get_pagetable_page_from_vm(vma)))
     {
-        KCL_MEM_IncPageCount_Mapping(pMmPage);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+        KCL_MEM_IncPageCount_Mapping(pMmPage);
         return pMmPage;
 #else
-        vmf->page = pMmPage;
-        return (0);
+        return kcl_vm_fault_map_page(vma, vmf, pMmPage);
 #endif
     }
 
@@ -3473,17 +4963,326 @@ static __inline__ int do_vm_kmap_fault(struct vm_area_struct *vma, struct vm_fau
     pMmPage = virt_to_page(kaddr);
     KCL_DEBUG3(FN_DRM_NOPAGE,"pMmPage=0x%08lx\n", (unsigned long)pMmPage);
 
-    KCL_MEM_IncPageCount_Mapping(pMmPage);
-
     KCL_DEBUG3(FN_DRM_NOPAGE,"vm-address 0x%08lx => kernel-page-address 0x%p\n", address, page_address(pMmPage));
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+    KCL_MEM_IncPageCount_Mapping(pMmPage);
     return pMmPage;
 #else
-    vmf->page = pMmPage;
+    return kcl_vm_fault_map_page(vma, vmf, pMmPage);
+#endif
+}
+
+/* KCL private data of a mapping.
+ *
+ * Some mapping types keep KCL state next to the core private data of the
+ * VMA. KCL_MEM_VM_MapRegion wraps the core private data in a structure that
+ * starts with a kcl_vm_private_t, and KCL_MEM_VM_GetRegionPrivateData hands
+ * the core its own private data back. The wrapper is shared by all VMAs
+ * derived from the original mapping (fork, split) and is reference counted
+ * through the vm_ops open/close callbacks.
+ */
+typedef struct kcl_vm_private_tag
+{
+    void*           private_data;   /* core private data of the mapping */
+    atomic_t        ref_count;      /* number of VMAs using the wrapper */
+    int             vmalloced;
+    void            (*release)(struct kcl_vm_private_tag* header); /* optional */
+} kcl_vm_private_t;
 
-    return (0);
+/* Per-VMA page cache for __KE_SG and GART mappings.
+ *
+ * Resolving a page of these mappings takes several lookups into the core
+ * heaps. The first fault resolves every page of the VMA in one pass, so
+ * later faults are a plain array lookup. The backing pages stay allocated
+ * for the lifetime of the mapping.
+ */
+typedef struct kcl_vm_page_cache_tag
+{
+    kcl_vm_private_t header;
+    int             populated;      /* set once the first fault filled the array */
+    unsigned long   pgoff;          /* vm_pgoff of the original mapping */
+    unsigned long   pages;
+    struct page*    page[0];
+} kcl_vm_page_cache_t;
+
+/* Lazily mapped aperture, see KCL_MEM_VM_MapRegionAperture */
+typedef struct kcl_vm_aperture_tag
+{
+    kcl_vm_private_t header;
+    unsigned long   pfn;            /* first PFN of the mapped range */
+    unsigned long   pgoff;          /* vm_pgoff of the original mapping */
+    unsigned long   pages;          /* size of the mapped range */
+    int             reserve_type;   /* KCL_PAGE_CACHE_* to reserve, -1 for none */
+    struct mutex    lock;           /* protects reserve */
+    int             vmalloced;
+    void __iomem**  reserve;        /* per chunk, keeps its memory type reserved */
+} kcl_vm_aperture_t;
+
+/* Dirty page tracker of a shared SHM buffer, see KCL_MEM_DirtyTracker_Create */
+typedef struct kcl_dirty_tracker_tag
+{
+    atomic_t                ref_count;      /* creator plus one per tracked mapping */
+    struct rw_semaphore     sem;            /* serializes collections and mapping setup */
+    spinlock_t              lock;           /* protects bitmap and written */
+    int                     vmalloced;
+    struct address_space*   mapping;        /* file mapping the buffer is mapped through */
+    unsigned long           pgoff;          /* page offset of the buffer in the mapping */
+    unsigned long           pages;
+    struct page**           written;        /* referenced page of each set bit */
+    unsigned long           bitmap[0];      /* one bit per written page */
+} kcl_dirty_tracker_t;
+
+/* Tracked SHM mapping, see KCL_MEM_VM_MapRegionTracked */
+typedef struct kcl_vm_shm_tracked_tag
+{
+    kcl_vm_private_t        header;
+    kcl_dirty_tracker_t*    tracker;
+} kcl_vm_shm_tracked_t;
+
+/* Lazily populated GART buffer, see KCL_MEM_Sparse_Create */
+typedef struct kcl_sparse_buffer_tag
+{
+    atomic_t                ref_count;      /* creator plus one per mapping */
+    struct rw_semaphore     sem;            /* page population */
+    int                     vmalloced;
+    KCL_SPARSE_BindCallback_t bind;
+    void*                   context;        /* passed to bind */
+    unsigned long           pages;
+    unsigned long           resident;       /* populated pages */
+    struct page*            page[0];
+} kcl_sparse_buffer_t;
+
+/* Mapping of a sparse buffer, see KCL_MEM_VM_MapRegionSparse */
+typedef struct kcl_vm_sparse_tag
+{
+    kcl_vm_private_t        header;
+    unsigned long           pgoff;          /* vm_pgoff of the first buffer page */
+    kcl_sparse_buffer_t*    buffer;
+} kcl_vm_sparse_t;
+
+static struct vm_operations_struct vm_pcie_ops;
+static struct vm_operations_struct vm_gart_ops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+static struct vm_operations_struct vm_aperture_ops;
+static struct vm_operations_struct vm_shm_tracked_ops;
+static struct vm_operations_struct vm_sparse_ops;
+#endif
+
+static atomic_t kcl_vm_page_cache_misses = ATOMIC_INIT(0);
+
+static __inline__ int kcl_vm_is_page_cached(struct vm_area_struct* vma)
+{
+    return (vma->vm_ops == &vm_pcie_ops) || (vma->vm_ops == &vm_gart_ops);
+}
+
+static __inline__ int kcl_vm_has_private(struct vm_area_struct* vma)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    if ((vma->vm_ops == &vm_aperture_ops) ||
+        (vma->vm_ops == &vm_shm_tracked_ops) ||
+        (vma->vm_ops == &vm_sparse_ops))
+    {
+        return 1;
+    }
 #endif
+    return kcl_vm_is_page_cached(vma);
+}
+
+static void* kcl_vm_private_alloc(unsigned long size, void* private_data)
+{
+    kcl_vm_private_t* header;
+    int vmalloced = 0;
+
+    if (size <= PAGE_SIZE)
+    {
+        header = kmalloc(size, GFP_KERNEL);
+    }
+    else
+    {
+        header = vmalloc(size);
+        vmalloced = 1;
+    }
+
+    if (header == NULL)
+    {
+        return NULL;
+    }
+
+    memset(header, 0, size);
+    header->private_data = private_data;
+    atomic_set(&header->ref_count, 1);
+    header->vmalloced = vmalloced;
+
+    return header;
+}
+
+static void kcl_vm_private_put(kcl_vm_private_t* header)
+{
+    if (!atomic_dec_and_test(&header->ref_count))
+    {
+        return;
+    }
+
+    if (header->release)
+    {
+        header->release(header);
+    }
+
+    if (header->vmalloced)
+    {
+        vfree(header);
+    }
+    else
+    {
+        kfree(header);
+    }
+}
+
+static kcl_vm_page_cache_t* kcl_vm_page_cache_alloc(struct vm_area_struct* vma, void* private_data)
+{
+    kcl_vm_page_cache_t* cache;
+    unsigned long pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+
+    cache = kcl_vm_private_alloc(sizeof(*cache) + pages * sizeof(cache->page[0]), private_data);
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->pgoff = vma->vm_pgoff;
+    cache->pages = pages;
+
+    return cache;
+}
+
+/* Index of the page backing address in the cache. The page offset is
+ * used instead of the address, so mremap'ed and split VMAs index the
+ * pages of the original mapping. Returns cache->pages if out of range.
+ */
+static __inline__ unsigned long kcl_vm_page_cache_index(kcl_vm_page_cache_t* cache,
+                                                       struct vm_area_struct* vma,
+                                                       unsigned long address)
+{
+    unsigned long i = ((address - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+
+    if (address < vma->vm_start || i < cache->pgoff || i - cache->pgoff >= cache->pages)
+    {
+        return cache->pages;
+    }
+
+    return i - cache->pgoff;
+}
+
+/** \brief Get a page of a cached mapping
+ *
+ * On the first miss every page of the VMA is looked up, later misses only
+ * look up the faulting page.
+ *
+ * \param vma      VMA of a __KE_SG or GART mapping [in]
+ * \param address  faulting address [in]
+ * \param lookup   core lookup of a single page [in]
+ *
+ * \return page or NULL if the address is not backed
+ */
+static struct page* kcl_vm_page_cache_get(struct vm_area_struct* vma,
+                                          unsigned long address,
+                                          struct page* (*lookup)(struct vm_area_struct*, unsigned long))
+{
+    kcl_vm_page_cache_t* cache = (kcl_vm_page_cache_t*)vma->vm_private_data;
+    unsigned long i = kcl_vm_page_cache_index(cache, vma, address);
+    unsigned long addr;
+    unsigned long j;
+
+    if (i >= cache->pages)
+    {
+        return NULL;
+    }
+
+    if (cache->page[i])
+    {
+        return cache->page[i];
+    }
+
+    atomic_inc(&kcl_vm_page_cache_misses);
+
+    if (cache->populated)
+    {
+        /* Pairs with the smp_wmb below, the entries are visible now */
+        smp_rmb();
+        if (cache->page[i])
+        {
+            return cache->page[i];
+        }
+        cache->page[i] = lookup(vma, address);
+    }
+    else
+    {
+        /* Concurrent faults may fill the same entries, they store identical values */
+        for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE)
+        {
+            j = kcl_vm_page_cache_index(cache, vma, addr);
+            if (j < cache->pages && cache->page[j] == NULL)
+            {
+                cache->page[j] = lookup(vma, addr);
+            }
+        }
+        /* Publish the entries before the flag */
+        smp_wmb();
+        cache->populated = 1;
+    }
+
+    return cache->page[i];
+}
+
+/** \brief Look up a page of a __KE_SG mapping in the core pcie heaps
+ *
+ * \param vma      VMA of a __KE_SG mapping [in]
+ * \param address  address within the VMA [in]
+ *
+ * \return page or NULL if the address is not backed
+ */
+static struct page* kcl_vm_pcie_lookup_page(struct vm_area_struct* vma, unsigned long address)
+{
+    struct firegl_pcie_mem* pciemem;
+    mem_map_t* pMmPage;
+
+    if (firegl_get_dev_from_vm(vma) == NULL)
+    {
+        return NULL;
+    }
+
+    pciemem = firegl_get_pciemem_from_addr(vma, address);
+    if (pciemem == NULL)
+    {
+        return NULL;
+    }
+
+    if (firegl_get_pagelist_from_vm(vma) == NULL) 
+    {
+        return NULL;
+    }
+
+    /** Which entry in the pagelist */
+    pMmPage = virt_to_page(firegl_get_pcie_pageaddr_from_vm(vma, pciemem, (address - vma->vm_start) >> PAGE_SHIFT));
+    if (page_address(pMmPage) == 0x0)
+    {
+        return NULL;
+    }
+
+    return pMmPage;
+}
+
+/** \brief Look up a page of a GART mapping in the core heap
+ *
+ * \param vma      VMA of a __KE_GART_USWC or __KE_GART_CACHEABLE mapping [in]
+ * \param address  address within the VMA [in]
+ *
+ * \return page or NULL if the address is not backed
+ */
+static struct page* kcl_vm_gart_lookup_page(struct vm_area_struct* vma, unsigned long address)
+{
+    return (struct page*)mc_heap_get_page(vma, address - vma->vm_start);
 }
 
 /** 
@@ -3498,61 +5297,29 @@ static __inline__ vm_nopage_ret_t do_vm_pcie_nopage(struct vm_area_struct* vma,
 static __inline__ int do_vm_pcie_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26) */
 {
-
-    unsigned long vma_offset;
-    unsigned long i; 
     mem_map_t* pMmPage;
-    struct firegl_pcie_mem* pciemem;
-    unsigned long* pagelist;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
     unsigned long address = (unsigned long) (vmf->virtual_address);
 #endif
-    
-    drm_device_t *dev = (drm_device_t *)firegl_get_dev_from_vm(vma);
-    if (dev == NULL)
-    {
-        KCL_DEBUG_ERROR("dev is NULL\n");
-        return (PAGING_FAULT_SIGBUS);
-    }
 
     if (address > vma->vm_end)
     {
         KCL_DEBUG_ERROR("address out of range\n");
         return (PAGING_FAULT_SIGBUS); /* address is out of range */
     }
-    pciemem = firegl_get_pciemem_from_addr ( vma, address);
-    if (pciemem == NULL)
-    {
-        KCL_DEBUG_ERROR("No pciemem found! \n");
-        return (PAGING_FAULT_SIGBUS);
-    }    
-    pagelist = firegl_get_pagelist_from_vm(vma);
 
-    if (pagelist == NULL) 
+    pMmPage = kcl_vm_page_cache_get(vma, address, kcl_vm_pcie_lookup_page);
+    if (pMmPage == NULL)
     {
-        KCL_DEBUG_ERROR("No pagelist! \n");
+        KCL_DEBUG_ERROR("No page found for address 0x%lx\n", address);
         return (PAGING_FAULT_SIGBUS);
     }
-     
-    /** Find offset in  vma */
-    vma_offset = address - vma->vm_start;
-    /** Which entry in the pagelist */
-    i = vma_offset >> PAGE_SHIFT;
-    pMmPage = virt_to_page(firegl_get_pcie_pageaddr_from_vm(vma,pciemem, i));
-
-    KCL_MEM_IncPageCount_Mapping(pMmPage);
 
-    if (page_address(pMmPage) == 0x0)
-    {
-        KCL_DEBUG_ERROR("Invalid page address\n");
-        return (PAGING_FAULT_SIGBUS);
-    }
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+    KCL_MEM_IncPageCount_Mapping(pMmPage);
     return pMmPage;
 #else
-    vmf->page = pMmPage;
-
-    return (0);
+    return kcl_vm_fault_map_page(vma, vmf, pMmPage);
 #endif
 }
 
@@ -3563,8 +5330,6 @@ static __inline__ vm_nopage_ret_t do_vm_gart_nopage(struct vm_area_struct* vma,
 static __inline__ int do_vm_gart_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26) */
 {
-
-    unsigned long offset;
     struct page *page;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
     unsigned long address = (unsigned long) (vmf->virtual_address);
@@ -3576,23 +5341,270 @@ static __inline__ int do_vm_gart_fault(struct vm_area_struct *vma, struct vm_fau
         return (PAGING_FAULT_SIGBUS); /* Disallow mremap */
     }          
 
-    offset      = address - vma->vm_start;
-    page   = (struct page*)mc_heap_get_page(vma, offset);
+    page = kcl_vm_page_cache_get(vma, address, kcl_vm_gart_lookup_page);
     if( !page)
     {
         KCL_DEBUG_ERROR("Invalid page pointer\n");
         return (PAGING_FAULT_SIGBUS); /* Disallow mremap */
     }
-    KCL_MEM_IncPageCount_Mapping(page);
-
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+    KCL_MEM_IncPageCount_Mapping(page);
     return page;
 #else
-    vmf->page = page;
+    return kcl_vm_fault_map_page(vma, vmf, page);
+#endif
+}
 
-    return (0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+/* Size of the naturally aligned block of an aperture mapping that is
+ * populated by one fault, and of the ranges its memory type is reserved in. */
+#define KCL_VM_APERTURE_CHUNK_PAGES 64
+#define KCL_VM_APERTURE_CHUNK_SIZE  (KCL_VM_APERTURE_CHUNK_PAGES * PAGE_SIZE)
+
+static atomic_t kcl_vm_aperture_faults = ATOMIC_INIT(0);
+
+/** \brief Reserve the memory type of an aperture chunk
+ *
+ * With kernel PAT support the cache attribute of inserted PFNs follows the
+ * memory type reserved for the range. The type is reserved with an ioremap
+ * of the chunk on its first fault, so only touched chunks cost kernel page
+ * tables. The mappings are kept until the last VMA is closed.
+ *
+ * \param aperture  aperture mapping [in]
+ * \param chunk     index of the chunk in the aperture [in]
+ *
+ * \return 0 on success, kernel defined error code otherwise
+ */
+static int kcl_vm_aperture_reserve(kcl_vm_aperture_t* aperture, unsigned long chunk)
+{
+    unsigned long chunks = DIV_ROUND_UP(aperture->pages, KCL_VM_APERTURE_CHUNK_PAGES);
+    unsigned long first = chunk * KCL_VM_APERTURE_CHUNK_PAGES;
+    unsigned long long phys;
+    unsigned long size;
+    int ret = 0;
+
+    mutex_lock(&aperture->lock);
+
+    if (aperture->reserve == NULL)
+    {
+        size = chunks * sizeof(*aperture->reserve);
+        if (size <= PAGE_SIZE)
+        {
+            aperture->reserve = kmalloc(size, GFP_KERNEL);
+        }
+        else
+        {
+            aperture->reserve = vmalloc(size);
+            aperture->vmalloced = 1;
+        }
+
+        if (aperture->reserve == NULL)
+        {
+            ret = -ENOMEM;
+            goto out;
+        }
+        memset(aperture->reserve, 0, size);
+    }
+
+    if (aperture->reserve[chunk] == NULL)
+    {
+        phys = (unsigned long long)(aperture->pfn + first) << PAGE_SHIFT;
+        size = min(aperture->pages - first, (unsigned long)KCL_VM_APERTURE_CHUNK_PAGES) << PAGE_SHIFT;
+
+#ifdef FIREGL_USWC_SUPPORT
+        if (aperture->reserve_type == KCL_PAGE_CACHE_WC)
+        {
+            aperture->reserve[chunk] = ioremap_wc(phys, size);
+        }
+        else
+#endif
+        {
+            aperture->reserve[chunk] = ioremap_nocache(phys, size);
+        }
+
+        if (aperture->reserve[chunk] == NULL)
+        {
+            KCL_DEBUG_ERROR("Cannot reserve the memory type of the aperture mapping\n");
+            ret = -EAGAIN;
+        }
+    }
+
+out:
+    mutex_unlock(&aperture->lock);
+    return ret;
+}
+
+/** 
+ **
+ **  This routine populates the chunk of a lazily mapped aperture
+ **  containing the faulting address with the aperture PFNs
+ **/
+static __inline__ int do_vm_aperture_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    kcl_vm_aperture_t* aperture = (kcl_vm_aperture_t*)vma->vm_private_data;
+    unsigned long address = (unsigned long) (vmf->virtual_address);
+    unsigned long start, end, addr;
+    unsigned long index;
+    unsigned long chunk = ULONG_MAX;
+    int ret;
+
+    /* Page offset relative to the original mapping, so that mremap'ed or
+     * split VMAs keep mapping the same part of the aperture */
+    if (address < vma->vm_start || address >= vma->vm_end ||
+        vma->vm_pgoff < aperture->pgoff ||
+        vma->vm_pgoff - aperture->pgoff + ((vma->vm_end - vma->vm_start) >> PAGE_SHIFT) > aperture->pages)
+    {
+        return (PAGING_FAULT_SIGBUS);
+    }
+
+    start = address & ~(KCL_VM_APERTURE_CHUNK_SIZE - 1);
+    end = start + KCL_VM_APERTURE_CHUNK_SIZE;
+    start = max(start, vma->vm_start);
+    end = min(end, vma->vm_end);
+
+    for (addr = start; addr < end; addr += PAGE_SIZE)
+    {
+        index = vma->vm_pgoff - aperture->pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+
+        /* A block of the VMA spans at most two chunks of the aperture */
+        if (aperture->reserve_type >= 0 && index / KCL_VM_APERTURE_CHUNK_PAGES != chunk)
+        {
+            chunk = index / KCL_VM_APERTURE_CHUNK_PAGES;
+            ret = kcl_vm_aperture_reserve(aperture, chunk);
+            if (ret)
+            {
+                return (ret == -ENOMEM) ? VM_FAULT_OOM : PAGING_FAULT_SIGBUS;
+            }
+        }
+
+        ret = vm_insert_pfn(vma, addr, aperture->pfn + index);
+
+        /* -EBUSY: the PTE is already populated, e.g. by a concurrent fault */
+        if (ret && ret != -EBUSY)
+        {
+            return (ret == -ENOMEM) ? VM_FAULT_OOM : PAGING_FAULT_SIGBUS;
+        }
+    }
+
+    atomic_inc(&kcl_vm_aperture_faults);
+
+    return VM_FAULT_NOPAGE;
+}
 #endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+static atomic_t kcl_shm_dirty_faults = ATOMIC_INIT(0);
+
+/** 
+ **
+ **  This routine records the first CPU write to a page of a tracked
+ **  SHM mapping in the dirty bitmap of the buffer
+ **/
+static __inline__ int do_vm_shm_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    kcl_vm_shm_tracked_t* tracked = (kcl_vm_shm_tracked_t*)vma->vm_private_data;
+    kcl_dirty_tracker_t* tracker = tracked->tracker;
+    unsigned long i = vmf->pgoff - tracker->pgoff;
+
+    /* vm_pgoff follows mremap, so the file offset stays valid where
+     * vm_start does not. All tracked mappings share tracker->pgoff. */
+    if (vmf->pgoff < tracker->pgoff || i >= tracker->pages)
+    {
+        return (PAGING_FAULT_SIGBUS);
+    }
+
+    /* The page stays locked until the writable PTE is installed. Collect
+     * takes the same lock, so it either sees the PTE and zaps it or the
+     * bit is set again after the collection. */
+    lock_page(vmf->page);
+
+    spin_lock(&tracker->lock);
+    if (!test_and_set_bit(i, tracker->bitmap))
+    {
+        get_page(vmf->page);
+        tracker->written[i] = vmf->page;
+    }
+    spin_unlock(&tracker->lock);
+
+    atomic_inc(&kcl_shm_dirty_faults);
+
+    /* vmalloc pages have no page->mapping, report the page as locked so the
+     * generic code does not treat it as truncated and retry forever */
+    return VM_FAULT_LOCKED;
+}
+
+static atomic_t kcl_sparse_faults = ATOMIC_INIT(0);
+static atomic_t kcl_sparse_resident_pages = ATOMIC_INIT(0);
+
+/* Allocate, zero and bind page i of a sparse buffer, the caller holds
+ * buffer->sem for writing */
+static int kcl_sparse_populate(kcl_sparse_buffer_t* buffer, unsigned long i)
+{
+    struct page* page;
+
+    if (buffer->page[i])
+    {
+        return 0;
+    }
+
+    page = kcl_alloc_gart_page(__GFP_ZERO);
+    if (page == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    buffer->page[i] = page;
+    buffer->resident++;
+    atomic_inc(&kcl_sparse_resident_pages);
+
+    if (buffer->bind)
+    {
+        buffer->bind(buffer->context, i, page);
+    }
+
+    return 0;
+}
+
+/** 
+ **
+ **  This routine maps the page of a sparse GART buffer, allocating
+ **  and binding it on first touch
+ **/
+static __inline__ int do_vm_sparse_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    kcl_vm_sparse_t* sparse = (kcl_vm_sparse_t*)vma->vm_private_data;
+    kcl_sparse_buffer_t* buffer = sparse->buffer;
+    unsigned long i = vmf->pgoff - sparse->pgoff;
+    struct page* page;
+
+    /* Index by file offset, vm_start no longer matches after mremap */
+    if (vmf->pgoff < sparse->pgoff || i >= buffer->pages)
+    {
+        return (PAGING_FAULT_SIGBUS);
+    }
+
+    atomic_inc(&kcl_sparse_faults);
+
+    down_read(&buffer->sem);
+    page = buffer->page[i];
+    up_read(&buffer->sem);
+
+    if (page == NULL)
+    {
+        down_write(&buffer->sem);
+        if (kcl_sparse_populate(buffer, i))
+        {
+            up_write(&buffer->sem);
+            return VM_FAULT_OOM;
+        }
+        page = buffer->page[i];
+        up_write(&buffer->sem);
+    }
+
+    /* Pages are only freed with the buffer, after all mappings are gone */
+    return kcl_vm_fault_map_page(vma, vmf, page);
 }
+#endif
 
 
 
@@ -3672,6 +5684,11 @@ void* ATI_API_CALL KCL_MEM_VM_GetRegionFilePrivateData(struct vm_area_struct* vm
 
 void* ATI_API_CALL KCL_MEM_VM_GetRegionPrivateData(struct vm_area_struct* vma)
 {
+    if (kcl_vm_has_private(vma))
+    {
+        return ((kcl_vm_private_t*)vma->vm_private_data)->private_data;
+    }
+
     return vma->vm_private_data;
 }
 
@@ -3801,6 +5818,21 @@ void ip_drm_vm_close(struct vm_area_struct* vma)
     TRACE_VM_OPEN_CLOSE(drm_vm_close, vma);  
 }
 
+static void ip_drm_vm_private_open(struct vm_area_struct* vma)
+{
+    atomic_inc(&((kcl_vm_private_t*)vma->vm_private_data)->ref_count);
+    TRACE_VM_OPEN_CLOSE(drm_vm_open, vma);
+}
+
+static void ip_drm_vm_private_close(struct vm_area_struct* vma)
+{
+    kcl_vm_private_t* header = (kcl_vm_private_t*)vma->vm_private_data;
+
+    /* The core still needs its private data, drop the wrapper afterwards */
+    TRACE_VM_OPEN_CLOSE(drm_vm_close, vma);
+    kcl_vm_private_put(header);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)  
 
 #define TRACE_NOPAGE(_f, _v,_a,_t)                  \
@@ -3898,6 +5930,24 @@ static int ip_vm_gart_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
     TRACE_FAULT(do_vm_gart_fault, vma, vmf);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+static int ip_vm_aperture_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    TRACE_FAULT(do_vm_aperture_fault, vma, vmf);
+}
+
+static int ip_vm_shm_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    TRACE_FAULT(do_vm_shm_mkwrite, vma, vmf);
+}
+
+static int ip_vm_sparse_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    TRACE_FAULT(do_vm_sparse_fault, vma, vmf);
+}
+
+#endif
+
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26) */
 
 static struct vm_operations_struct vm_ops =
@@ -3922,6 +5972,23 @@ static struct vm_operations_struct vm_shm_ops =
     close:   ip_drm_vm_close,
 };
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+static struct vm_operations_struct vm_shm_tracked_ops =
+{
+    fault:          ip_vm_shm_fault,
+    page_mkwrite:   ip_vm_shm_mkwrite,
+    open:           ip_drm_vm_private_open,
+    close:          ip_drm_vm_private_close,
+};
+
+static struct vm_operations_struct vm_sparse_ops =
+{
+    fault:   ip_vm_sparse_fault,
+    open:    ip_drm_vm_private_open,
+    close:   ip_drm_vm_private_close,
+};
+#endif
+
 static struct vm_operations_struct vm_pci_bq_ops =
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)  
@@ -3944,6 +6011,14 @@ static struct vm_operations_struct vm_ctx_ops =
     close:   ip_drm_vm_close,
 };
 
+/* Ring and fence pages are prefilled with remap_vmalloc_range, no fault
+ * handler needed */
+static struct vm_operations_struct vm_ring_ops =
+{
+    open:    ip_drm_vm_open,
+    close:   ip_drm_vm_close,
+};
+
 static struct vm_operations_struct vm_pcie_ops = 
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)  
@@ -3951,8 +6026,8 @@ static struct vm_operations_struct vm_pcie_ops =
 #else
     fault:   ip_vm_pcie_fault,
 #endif
-    open:    ip_drm_vm_open,
-    close:   ip_drm_vm_close,
+    open:    ip_drm_vm_private_open,
+    close:   ip_drm_vm_private_close,
 };
 
 static struct vm_operations_struct vm_kmap_ops =
@@ -3973,8 +6048,8 @@ static struct vm_operations_struct vm_gart_ops =
 #else
     fault:   ip_vm_gart_fault,
 #endif
-    open:    ip_drm_vm_open,
-    close:   ip_drm_vm_close,
+    open:    ip_drm_vm_private_open,
+    close:   ip_drm_vm_private_close,
 };
 
 #ifdef __AGP__BUILTIN__
@@ -3990,21 +6065,25 @@ static struct vm_operations_struct vm_agp_bq_ops =
 };
 #endif /* __AGP__BUILTIN__ */
 
-int ATI_API_CALL KCL_MEM_VM_MapRegion(KCL_IO_FILE_Handle filp,
-                             struct vm_area_struct* vma, unsigned long long offset,
-                             enum kcl_vm_maptype type,
-                             int readonly,
-                             void *private_data)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+static struct vm_operations_struct vm_aperture_ops =
 {
-    unsigned int pages;
-
-    KCL_DEBUG3(FN_FIREGL_MMAP, "start=0x%08lx, "
-            "end=0x%08lx, "
-            "offset=0x%llx\n",
-            vma->vm_start,
-            vma->vm_end,
-            offset);
+    fault:   ip_vm_aperture_fault,
+    open:    ip_drm_vm_private_open,
+    close:   ip_drm_vm_private_close,
+};
+#endif
 
+/** \brief Set up the page protection of an aperture mapping
+ *
+ * \param vma     VMA being mapped [in/out]
+ * \param offset  physical address of the aperture range [in]
+ * \param type    __KE_ADPT, __KE_ADPT_REG, __KE_AGP or __KE_AGP_BQS [in]
+ */
+static void kcl_vm_aperture_set_prot(struct vm_area_struct* vma,
+                                     unsigned long long offset,
+                                     enum kcl_vm_maptype type)
+{
     switch (type)
     {
         case __KE_ADPT:
@@ -4030,6 +6109,64 @@ int ATI_API_CALL KCL_MEM_VM_MapRegion(KCL_IO_FILE_Handle filp,
                 }
                 vma->vm_flags |= VM_IO; /* not in core dump */
             }
+            break;
+
+        case __KE_ADPT_REG:
+#if defined(__i386__) && !defined(CONFIG_X86_4G)
+            if (offset >= __pa(high_memory))
+#endif
+            {
+                /* Registers are never cached, with or without WC support */
+                if (boot_cpu_data.x86 > 3)
+                {
+                    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot); 
+                }
+                vma->vm_flags |= VM_IO; /* not in core dump */
+            }
+            break;
+
+        case __KE_AGP:
+        case __KE_AGP_BQS:
+#if defined(__i386__) && !defined(CONFIG_X86_4G)
+            if (offset >= __pa(high_memory))
+#endif
+                vma->vm_flags |= VM_IO; /* not in core dump */
+
+#ifdef FIREGL_USWC_SUPPORT
+            if (boot_cpu_data.x86 > 3)
+            {
+                if (kcl_mem_pat_status != KCL_MEM_PAT_DISABLED)
+                {
+                    vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+                }    
+            }
+#endif                
+            break;
+
+        default:
+            break;
+    }
+}
+
+int ATI_API_CALL KCL_MEM_VM_MapRegion(KCL_IO_FILE_Handle filp,
+                             struct vm_area_struct* vma, unsigned long long offset,
+                             enum kcl_vm_maptype type,
+                             int readonly,
+                             void *private_data)
+{
+    unsigned int pages;
+
+    KCL_DEBUG3(FN_FIREGL_MMAP, "start=0x%08lx, "
+            "end=0x%08lx, "
+            "offset=0x%llx\n",
+            vma->vm_start,
+            vma->vm_end,
+            offset);
+
+    switch (type)
+    {
+        case __KE_ADPT:
+            kcl_vm_aperture_set_prot(vma, offset, type);
             if (REMAP_PAGE_RANGE(vma,offset))
             {
                 KCL_DEBUG_ERROR(REMAP_PAGE_RANGE_STR " failed\n");
@@ -4042,24 +6179,7 @@ int ATI_API_CALL KCL_MEM_VM_MapRegion(KCL_IO_FILE_Handle filp,
 #ifdef FIREGL_USWC_SUPPORT                
         case __KE_ADPT_REG:
 			{
-#if defined(__i386__) && !defined(CONFIG_X86_4G)
-            if (offset >= __pa(high_memory))
-#endif
-            {
-                if (boot_cpu_data.x86 > 3)
-                {
-                    if (kcl_mem_pat_status == KCL_MEM_PAT_DISABLED)
-                    {
-                        pgprot_val(vma->vm_page_prot) |= _PAGE_PCD;
-                        pgprot_val(vma->vm_page_prot) &= ~_PAGE_PWT;
-                    }
-                    else
-                    {
-                        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot); 
-                    }
-                }
-                vma->vm_flags |= VM_IO; /* not in core dump */
-            }
+            kcl_vm_aperture_set_prot(vma, offset, type);
             if (REMAP_PAGE_RANGE(vma,offset))
             {
                 KCL_DEBUG_ERROR(REMAP_PAGE_RANGE_STR " failed\n");
@@ -4071,143 +6191,1449 @@ int ATI_API_CALL KCL_MEM_VM_MapRegion(KCL_IO_FILE_Handle filp,
 			break;
 #endif                    
 
-        case __KE_SHM:
-            vma->vm_flags |= VM_SHM | VM_RESERVED; /* Don't swap */
-            vma->vm_ops = &vm_shm_ops;
+        case __KE_SHM:
+            vma->vm_flags |= VM_SHM | VM_RESERVED; /* Don't swap */
+            vma->vm_ops = &vm_shm_ops;
+            break;
+
+        case __KE_SG:
+
+            pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+
+            vma->vm_flags |= VM_RESERVED;
+
+            //vma->vm_flags |=  VM_SHM | VM_LOCKED; /* DDDDDDDDDDon't swap */
+            //vma->vm_mm->locked_vm += pages; /* Kernel tracks aqmount of locked pages */
+            vma->vm_ops = &vm_pcie_ops;
+            break;
+
+        case __KE_CTX:
+            pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+            vma->vm_flags |= VM_LOCKED | VM_SHM | VM_RESERVED; /* Don't swap */
+            vma->vm_mm->locked_vm += pages; /* Kernel tracks aqmount of locked pages */
+            vma->vm_ops = &vm_ctx_ops;
+            break;
+
+        case __KE_PCI_BQS:
+            pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+            vma->vm_flags |= VM_LOCKED | VM_SHM | VM_RESERVED; /* Don't swap */
+            vma->vm_mm->locked_vm += pages; /* Kernel tracks aqmount of locked pages */
+            vma->vm_ops = &vm_pci_bq_ops;
+            break;
+
+#ifdef __AGP__BUILTIN__
+        case __KE_AGP:
+            // if(dev->agp->cant_use_aperture == 1) 
+            // else
+            {
+                kcl_vm_aperture_set_prot(vma, offset, type);
+
+                if (REMAP_PAGE_RANGE(vma,offset))
+                {
+                    KCL_DEBUG_ERROR(REMAP_PAGE_RANGE_STR " failed\n");
+                    return -EAGAIN;
+                }
+#ifdef __x86_64__
+                vma->vm_flags |= VM_RESERVED;
+#else
+                vma->vm_flags |= VM_SHM | VM_RESERVED; /* Don't swap */
+#endif
+                vma->vm_ops = &vm_ops;
+            }
+            break;
+        case __KE_AGP_BQS:
+            // if(dev->agp->cant_use_aperture == 1) 
+            {
+                kcl_vm_aperture_set_prot(vma, offset, type);
+
+                if (REMAP_PAGE_RANGE(vma,offset))
+                {
+                    KCL_DEBUG_ERROR(REMAP_PAGE_RANGE_STR " failed\n");
+                    return -EAGAIN;
+                }
+#ifdef __x86_64__
+                vma->vm_flags |= VM_RESERVED;
+#else
+                vma->vm_flags |= VM_SHM | VM_RESERVED; /* Don't swap */
+#endif
+                vma->vm_ops = &vm_agp_bq_ops;
+            }
+            break;
+#endif /* __AGP__BUILTIN__ */
+
+        case __KE_KMAP:
+		    vma->vm_flags |= VM_SHM | VM_RESERVED;
+            vma->vm_ops = &vm_kmap_ops;
+            if (readonly && (vma->vm_flags & VM_WRITE))
+            {
+                KCL_DEBUG_ERROR("ERROR: cannot map a readonly map with PROT_WRITE!\n");
+                return -EINVAL; // write not allowed - explicitly fail the map!
+            }
+            break;
+
+         case __KE_GART_USWC:
+#ifdef FIREGL_USWC_SUPPORT         
+            if (boot_cpu_data.x86 > 3)
+            {
+                if (kcl_mem_pat_status != KCL_MEM_PAT_DISABLED)
+                {
+                    vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+                }    
+            }
+#endif            
+            // fall through
+         case __KE_GART_CACHEABLE:
+             vma->vm_flags |= VM_RESERVED;
+             vma->vm_ops = &vm_gart_ops;
+             break;
+
+        case __KE_RING:
+            /* offset is the address returned by KCL_RING_GetMapAddress */
+            if (remap_vmalloc_range(vma, (void*)(unsigned long)offset, 0))
+            {
+                KCL_DEBUG_ERROR("remap_vmalloc_range failed\n");
+                return -EAGAIN;
+            }
+            vma->vm_flags |= VM_RESERVED;
+            vma->vm_ops = &vm_ring_ops;
+            break;
+
+        case __KE_FENCE:
+            /* Only the driver updates the fences */
+            if (vma->vm_flags & VM_WRITE)
+            {
+                KCL_DEBUG_ERROR("ERROR: cannot map the fence page with PROT_WRITE!\n");
+                return -EINVAL;
+            }
+            vma->vm_flags &= ~VM_MAYWRITE;
+
+            /* offset is the address returned by KCL_FENCE_GetMapAddress */
+            if (remap_vmalloc_range(vma, (void*)(unsigned long)offset, 0))
+            {
+                KCL_DEBUG_ERROR("remap_vmalloc_range failed\n");
+                return -EAGAIN;
+            }
+            vma->vm_flags |= VM_RESERVED;
+            vma->vm_ops = &vm_ring_ops;
+            break;
+
+        default:
+            /*  This should never happen anyway! */
+            KCL_DEBUG_ERROR("kcl_vm_map: Unknown type %d\n", type);
+            return -EINVAL;
+    }
+
+    if (readonly)
+    {
+        vma->vm_flags &= ~(VM_WRITE | VM_MAYWRITE);
+		pgprot_val(vma->vm_page_prot) &= ~_PAGE_RW;
+    }
+
+    vma->vm_file = (struct file*)filp;    /* Needed for drm_vm_open() */
+
+    if (kcl_vm_is_page_cached(vma))
+    {
+        private_data = kcl_vm_page_cache_alloc(vma, private_data);
+        if (private_data == NULL)
+        {
+            KCL_DEBUG_ERROR("Out of memory when allocating page cache of the mapping\n");
+            return -ENOMEM;
+        }
+    }
+
+    vma->vm_private_data = private_data;
+
+    return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+static void kcl_vm_aperture_release(kcl_vm_private_t* header)
+{
+    kcl_vm_aperture_t* aperture = (kcl_vm_aperture_t*)header;
+    unsigned long chunks = DIV_ROUND_UP(aperture->pages, KCL_VM_APERTURE_CHUNK_PAGES);
+    unsigned long i;
+
+    if (aperture->reserve == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < chunks; i++)
+    {
+        if (aperture->reserve[i])
+        {
+            iounmap(aperture->reserve[i]);
+        }
+    }
+
+    if (aperture->vmalloced)
+    {
+        vfree(aperture->reserve);
+    }
+    else
+    {
+        kfree(aperture->reserve);
+    }
+}
+#endif
+
+/** \brief Map an aperture range on demand
+ *
+ * Instead of building all PTEs of the range at mmap time the VMA is set up
+ * as VM_PFNMAP and do_vm_aperture_fault inserts the PFNs of an aligned
+ * chunk on first touch, so the cost of mmap no longer depends on the
+ * aperture size.
+ *
+ * With kernel PAT support the type the eager path would use (WC for
+ * __KE_ADPT and __KE_AGP, UC for __KE_ADPT_REG) is reserved chunk by chunk
+ * as the chunks are touched, see kcl_vm_aperture_reserve.
+ *
+ * Private writable mappings and lowmem ranges fall back to
+ * KCL_MEM_VM_MapRegion.
+ *
+ * \return 0 on success, kernel defined error code otherwise
+ */
+int ATI_API_CALL KCL_MEM_VM_MapRegionAperture(KCL_IO_FILE_Handle filp,
+                             struct vm_area_struct* vma, unsigned long long offset,
+                             enum kcl_vm_maptype type,
+                             int readonly,
+                             void *private_data)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    kcl_vm_aperture_t* aperture;
+
+    switch (type)
+    {
+        case __KE_ADPT:
+        case __KE_ADPT_REG:
+        case __KE_AGP:
+            break;
+        default:
+            KCL_DEBUG_ERROR("Type %d is not an aperture\n", type);
+            return -EINVAL;
+    }
+
+    /* Private writable mappings and system memory need struct pages */
+    if (((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE)
+#if defined(__i386__) && !defined(CONFIG_X86_4G)
+        || (offset < __pa(high_memory))
+#endif
+       )
+    {
+        return KCL_MEM_VM_MapRegion(filp, vma, offset, type, readonly, private_data);
+    }
+
+    aperture = kcl_vm_private_alloc(sizeof(*aperture), private_data);
+    if (aperture == NULL)
+    {
+        KCL_DEBUG_ERROR("Out of memory when allocating aperture mapping\n");
+        return -ENOMEM;
+    }
+
+    aperture->header.release = kcl_vm_aperture_release;
+    aperture->pfn = (unsigned long)(offset >> PAGE_SHIFT);
+    aperture->pgoff = vma->vm_pgoff;
+    aperture->pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+    aperture->reserve_type = -1;
+    mutex_init(&aperture->lock);
+
+#ifdef FIREGL_USWC_SUPPORT
+    if (kcl_mem_pat_status != KCL_MEM_PAT_DISABLED && boot_cpu_data.x86 > 3)
+    {
+        aperture->reserve_type = (type == __KE_ADPT_REG) ? KCL_PAGE_CACHE_UC : KCL_PAGE_CACHE_WC;
+    }
+#endif
+
+    kcl_vm_aperture_set_prot(vma, offset, type);
+    vma->vm_flags |= VM_IO | VM_PFNMAP | VM_RESERVED;
+    vma->vm_ops = &vm_aperture_ops;
+
+    if (readonly)
+    {
+        vma->vm_flags &= ~(VM_WRITE | VM_MAYWRITE);
+        pgprot_val(vma->vm_page_prot) &= ~_PAGE_RW;
+    }
+
+    vma->vm_file = (struct file*)filp;    /* Needed for drm_vm_open() */
+    vma->vm_private_data = aperture;
+
+    return 0;
+#else
+    return KCL_MEM_VM_MapRegion(filp, vma, offset, type, readonly, private_data);
+#endif
+}
+
+/** \brief Map a region without page reference counting
+ *
+ * Same as KCL_MEM_VM_MapRegion, but the pages are inserted into the page
+ * tables as raw PFNs (VM_MIXEDMAP). Faults and unmaps of such a mapping do
+ * not touch the page reference counts, which avoids bouncing the counts of
+ * buffers mapped by many processes between CPUs.
+ *
+ * The caller must guarantee that the backing pages stay allocated until the
+ * last VMA of the mapping is closed. For __KE_GART_USWC the linear mapping
+ * of the pages should be write-combined as well (KCL_SetPageCache_Array
+ * with KCL_PAGE_CACHE_WC). With PAT, pages that are still cached in the
+ * linear mapping are mapped with page references instead, so that they
+ * keep the requested cache type.
+ *
+ * Aperture types have no struct pages and are rejected, they are mapped
+ * lazily with KCL_MEM_VM_MapRegionAperture.
+ *
+ * \return 0 on success, kernel defined error code otherwise
+ */
+int ATI_API_CALL KCL_MEM_VM_MapRegionPfn(KCL_IO_FILE_Handle filp,
+                             struct vm_area_struct* vma, unsigned long long offset,
+                             enum kcl_vm_maptype type,
+                             int readonly,
+                             void *private_data)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+    int ret;
+
+    switch (type)
+    {
+        case __KE_CTX:
+        case __KE_PCI_BQS:
+        case __KE_KMAP:
+        case __KE_SG:
+        case __KE_GART_USWC:
+        case __KE_GART_CACHEABLE:
+            break;
+        default:
+            KCL_DEBUG_ERROR("Type %d cannot be mapped by PFN\n", type);
+            return -EINVAL;
+    }
+
+    ret = KCL_MEM_VM_MapRegion(filp, vma, offset, type, readonly, private_data);
+    if (ret == 0)
+    {
+        vma->vm_flags |= VM_MIXEDMAP;
+    }
+
+    return ret;
+#else
+    return KCL_MEM_VM_MapRegion(filp, vma, offset, type, readonly, private_data);
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+static void kcl_dirty_tracker_put(kcl_dirty_tracker_t* tracker)
+{
+    unsigned long i;
+
+    if (!atomic_dec_and_test(&tracker->ref_count))
+    {
+        return;
+    }
+
+    for (i = 0; i < tracker->pages; i++)
+    {
+        if (test_bit(i, tracker->bitmap))
+        {
+            put_page(tracker->written[i]);
+        }
+    }
+
+    if (tracker->vmalloced)
+    {
+        vfree(tracker);
+    }
+    else
+    {
+        kfree(tracker);
+    }
+}
+
+static void kcl_vm_shm_tracked_release(kcl_vm_private_t* header)
+{
+    kcl_dirty_tracker_put(((kcl_vm_shm_tracked_t*)header)->tracker);
+}
+#endif
+
+/** \brief Create a dirty page tracker for a shared SHM buffer
+ *
+ * SHM mappings created with KCL_MEM_VM_MapRegionTracked start write
+ * protected. The first CPU write to a page is recorded in the tracker, so
+ * the driver can copy or flush only the modified pages of a large buffer
+ * instead of scanning the PTEs with KCL_TestAndClearPageDirtyFlag.
+ *
+ * \param pages  size of the buffer in pages [in]
+ *
+ * \return tracker handle, NULL if out of memory or not supported by the
+ *         kernel. Callers fall back to PTE scanning in that case.
+ */
+void* ATI_API_CALL KCL_MEM_DirtyTracker_Create(unsigned int pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    kcl_dirty_tracker_t* tracker;
+    unsigned long bitmap_size = BITS_TO_LONGS(pages) * sizeof(unsigned long);
+    unsigned long size = sizeof(*tracker) + bitmap_size + pages * sizeof(struct page*);
+    int vmalloced = 0;
+
+    if (size <= PAGE_SIZE)
+    {
+        tracker = kmalloc(size, GFP_KERNEL);
+    }
+    else
+    {
+        tracker = vmalloc(size);
+        vmalloced = 1;
+    }
+
+    if (tracker == NULL)
+    {
+        return NULL;
+    }
+
+    memset(tracker, 0, size);
+    atomic_set(&tracker->ref_count, 1);
+    init_rwsem(&tracker->sem);
+    spin_lock_init(&tracker->lock);
+    tracker->vmalloced = vmalloced;
+    tracker->pages = pages;
+    tracker->written = (struct page**)((char*)tracker->bitmap + bitmap_size);
+
+    return tracker;
+#else
+    return NULL;
+#endif
+}
+
+/** \brief Release the creator reference of a dirty page tracker
+ *
+ * The tracker is freed once the last tracked mapping is closed as well.
+ *
+ * \param tracker  handle returned by KCL_MEM_DirtyTracker_Create [in]
+ */
+void ATI_API_CALL KCL_MEM_DirtyTracker_Destroy(void* tracker)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    if (tracker)
+    {
+        kcl_dirty_tracker_put((kcl_dirty_tracker_t*)tracker);
+    }
+#endif
+}
+
+/** \brief Collect and reset the pages written since the last collection
+ *
+ * Each written page is write protected again before its bit is cleared.
+ * Both steps happen under the page lock, which page_mkwrite holds until the
+ * writable PTE is installed, so a concurrent write is never lost.
+ *
+ * \param tracker  handle returned by KCL_MEM_DirtyTracker_Create [in]
+ * \param bitmap   one bit per page, set for written pages [out]
+ * \param pages    size of the bitmap in pages [in]
+ *
+ * \return number of written pages
+ */
+unsigned int ATI_API_CALL KCL_MEM_DirtyTracker_Collect(void* tracker, unsigned long* bitmap, unsigned int pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    kcl_dirty_tracker_t* t = (kcl_dirty_tracker_t*)tracker;
+    struct page* page;
+    unsigned int count = 0;
+    unsigned long i;
+
+    pages = min(pages, (unsigned int)t->pages);
+    bitmap_zero(bitmap, pages);
+
+    down_write(&t->sem);
+
+    for (i = 0; i < t->pages; i++)
+    {
+        spin_lock(&t->lock);
+        page = test_bit(i, t->bitmap) ? t->written[i] : NULL;
+        spin_unlock(&t->lock);
+
+        if (page == NULL)
+        {
+            continue;
+        }
+
+        lock_page(page);
+
+        if (t->mapping)
+        {
+            /* Dropping the PTEs makes the next write go through page_mkwrite */
+            unmap_mapping_range(t->mapping,
+                                (loff_t)(t->pgoff + i) << PAGE_SHIFT,
+                                PAGE_SIZE,
+                                0);
+        }
+
+        spin_lock(&t->lock);
+        clear_bit(i, t->bitmap);
+        t->written[i] = NULL;
+        spin_unlock(&t->lock);
+
+        unlock_page(page);
+        put_page(page);
+
+        if (i < pages)
+        {
+            set_bit(i, bitmap);
+        }
+        count++;
+    }
+
+    up_write(&t->sem);
+
+    return count;
+#else
+    return 0;
+#endif
+}
+
+/** \brief Map a SHM region with dirty page tracking
+ *
+ * Same as KCL_MEM_VM_MapRegion for __KE_SHM. Writes to a writable mapping
+ * are recorded in the tracker, see KCL_MEM_DirtyTracker_Create. All tracked
+ * mappings of a buffer must use the same map offset.
+ *
+ * \return 0 on success, kernel defined error code otherwise
+ */
+int ATI_API_CALL KCL_MEM_VM_MapRegionTracked(KCL_IO_FILE_Handle filp,
+                             struct vm_area_struct* vma, unsigned long long offset,
+                             int readonly,
+                             void *private_data,
+                             void *tracker)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    kcl_dirty_tracker_t* t = (kcl_dirty_tracker_t*)tracker;
+    kcl_vm_shm_tracked_t* tracked;
+    int ret;
+
+    ret = KCL_MEM_VM_MapRegion(filp, vma, offset, __KE_SHM, readonly, private_data);
+    if (ret || readonly || t == NULL)
+    {
+        return ret;
+    }
+
+    tracked = kcl_vm_private_alloc(sizeof(*tracked), private_data);
+    if (tracked == NULL)
+    {
+        KCL_DEBUG_ERROR("Out of memory when allocating tracked mapping\n");
+        return -ENOMEM;
+    }
+
+    atomic_inc(&t->ref_count);
+    tracked->header.release = kcl_vm_shm_tracked_release;
+    tracked->tracker = t;
+
+    down_write(&t->sem);
+    if (t->mapping == NULL)
+    {
+        t->mapping = vma->vm_file->f_mapping;
+        t->pgoff = vma->vm_pgoff;
+    }
+    up_write(&t->sem);
+
+    /* vm_ops with page_mkwrite make mmap write protect the shared mapping */
+    vma->vm_ops = &vm_shm_tracked_ops;
+    vma->vm_private_data = tracked;
+
+    return 0;
+#else
+    return KCL_MEM_VM_MapRegion(filp, vma, offset, __KE_SHM, readonly, private_data);
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+/* Zero page shared by the unpopulated entries of all sparse buffers,
+ * allocated by the first buffer and freed with the last one */
+static struct page* kcl_sparse_dummy_page;
+static int kcl_sparse_dummy_users;
+static DEFINE_MUTEX(kcl_sparse_dummy_lock);
+
+static struct page* kcl_sparse_dummy_get(void)
+{
+    struct page* page;
+
+    mutex_lock(&kcl_sparse_dummy_lock);
+    if (kcl_sparse_dummy_page == NULL)
+    {
+        kcl_sparse_dummy_page = kcl_alloc_gart_page(__GFP_ZERO);
+    }
+    page = kcl_sparse_dummy_page;
+    if (page)
+    {
+        kcl_sparse_dummy_users++;
+    }
+    mutex_unlock(&kcl_sparse_dummy_lock);
+
+    return page;
+}
+
+static void kcl_sparse_dummy_put(void)
+{
+    mutex_lock(&kcl_sparse_dummy_lock);
+    if (--kcl_sparse_dummy_users == 0)
+    {
+        __free_page(kcl_sparse_dummy_page);
+        kcl_sparse_dummy_page = NULL;
+    }
+    mutex_unlock(&kcl_sparse_dummy_lock);
+}
+
+static void kcl_sparse_buffer_put(kcl_sparse_buffer_t* buffer)
+{
+    unsigned long i;
+
+    if (!atomic_dec_and_test(&buffer->ref_count))
+    {
+        return;
+    }
+
+    for (i = 0; i < buffer->pages; i++)
+    {
+        if (buffer->page[i])
+        {
+            __free_page(buffer->page[i]);
+        }
+    }
+    atomic_sub(buffer->resident, &kcl_sparse_resident_pages);
+
+    kcl_sparse_dummy_put();
+
+    if (buffer->vmalloced)
+    {
+        vfree(buffer);
+    }
+    else
+    {
+        kfree(buffer);
+    }
+}
+
+static void kcl_vm_sparse_release(kcl_vm_private_t* header)
+{
+    kcl_sparse_buffer_put(((kcl_vm_sparse_t*)header)->buffer);
+}
+#endif
+
+/** \brief Create a lazily populated GART buffer
+ *
+ * No memory is allocated for the buffer pages up front. A page is
+ * allocated, zeroed and handed to the bind callback on the first CPU fault
+ * or by KCL_MEM_Sparse_Commit. Until then KCL_MEM_Sparse_GetPage returns a
+ * shared zeroed dummy page, which the core binds to the GART for the
+ * untouched ranges. The buffer pages are cacheable.
+ *
+ * The bind callback runs with the buffer locked and must not call back
+ * into the KCL_MEM_Sparse functions for the same buffer.
+ *
+ * \param pages    size of the buffer in pages [in]
+ * \param bind     called for every newly populated page, may be NULL [in]
+ * \param context  passed to bind [in]
+ *
+ * \return buffer handle, NULL if out of memory or not supported by the kernel.
+ *         Callers allocate the buffer up front in that case.
+ */
+void* ATI_API_CALL KCL_MEM_Sparse_Create(unsigned int pages,
+                                         KCL_SPARSE_BindCallback_t bind,
+                                         void* context)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    kcl_sparse_buffer_t* buffer;
+    unsigned long size = sizeof(*buffer) + pages * sizeof(buffer->page[0]);
+    int vmalloced = 0;
+
+    if (kcl_sparse_dummy_get() == NULL)
+    {
+        return NULL;
+    }
+
+    if (size <= PAGE_SIZE)
+    {
+        buffer = kmalloc(size, GFP_KERNEL);
+    }
+    else
+    {
+        buffer = vmalloc(size);
+        vmalloced = 1;
+    }
+
+    if (buffer == NULL)
+    {
+        kcl_sparse_dummy_put();
+        return NULL;
+    }
+
+    memset(buffer, 0, size);
+    atomic_set(&buffer->ref_count, 1);
+    init_rwsem(&buffer->sem);
+    buffer->vmalloced = vmalloced;
+    buffer->bind = bind;
+    buffer->context = context;
+    buffer->pages = pages;
+
+    return buffer;
+#else
+    return NULL;
+#endif
+}
+
+/** \brief Release the creator reference of a sparse buffer
+ *
+ * The pages are freed once the last mapping of the buffer is closed as well.
+ *
+ * \param buffer  handle returned by KCL_MEM_Sparse_Create [in]
+ */
+void ATI_API_CALL KCL_MEM_Sparse_Destroy(void* buffer)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    if (buffer)
+    {
+        kcl_sparse_buffer_put((kcl_sparse_buffer_t*)buffer);
+    }
+#endif
+}
+
+/** \brief Populate a range of a sparse buffer
+ *
+ * \param buffer  handle returned by KCL_MEM_Sparse_Create [in]
+ * \param first   first page of the range [in]
+ * \param count   number of pages [in]
+ *
+ * \return 0 on success, -ENOMEM if out of memory, -EINVAL for a bad range.
+ *         Pages populated before a failure stay resident.
+ */
+int ATI_API_CALL KCL_MEM_Sparse_Commit(void* buffer, unsigned int first, unsigned int count)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    kcl_sparse_buffer_t* b = (kcl_sparse_buffer_t*)buffer;
+    unsigned long i;
+    int ret = 0;
+
+    if ((unsigned long)first + count > b->pages)
+    {
+        return -EINVAL;
+    }
+
+    down_write(&b->sem);
+    for (i = first; i < (unsigned long)first + count; i++)
+    {
+        ret = kcl_sparse_populate(b, i);
+        if (ret)
+        {
+            break;
+        }
+    }
+    up_write(&b->sem);
+
+    return ret;
+#else
+    return -EINVAL;
+#endif
+}
+
+/** \brief Get the page backing a sparse buffer page
+ *
+ * \param buffer  handle returned by KCL_MEM_Sparse_Create [in]
+ * \param index   page index in the buffer [in]
+ *
+ * \return populated page, the shared dummy page if the page is not populated
+ */
+void* ATI_API_CALL KCL_MEM_Sparse_GetPage(void* buffer, unsigned int index)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    kcl_sparse_buffer_t* b = (kcl_sparse_buffer_t*)buffer;
+    struct page* page = NULL;
+
+    if (index < b->pages)
+    {
+        down_read(&b->sem);
+        page = b->page[index];
+        up_read(&b->sem);
+    }
+
+    return page ? page : kcl_sparse_dummy_page;
+#else
+    return NULL;
+#endif
+}
+
+/** \brief Get the resident size of a sparse buffer
+ *
+ * \param buffer  handle returned by KCL_MEM_Sparse_Create [in]
+ *
+ * \return size of the populated pages in bytes
+ */
+unsigned long ATI_API_CALL KCL_MEM_Sparse_GetResidentSize(void* buffer)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    return ((kcl_sparse_buffer_t*)buffer)->resident << PAGE_SHIFT;
+#else
+    return 0;
+#endif
+}
+
+/** \brief Map a sparse buffer
+ *
+ * Same as KCL_MEM_VM_MapRegion for __KE_GART_CACHEABLE, but the pages come
+ * from the sparse buffer and are populated on fault. The mapping starts at
+ * the first page of the buffer.
+ *
+ * \return 0 on success, kernel defined error code otherwise
+ */
+int ATI_API_CALL KCL_MEM_VM_MapRegionSparse(KCL_IO_FILE_Handle filp,
+                             struct vm_area_struct* vma, unsigned long long offset,
+                             int readonly,
+                             void *private_data,
+                             void *buffer)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    kcl_sparse_buffer_t* b = (kcl_sparse_buffer_t*)buffer;
+    kcl_vm_sparse_t* sparse;
+
+    if (b == NULL || ((vma->vm_end - vma->vm_start) >> PAGE_SHIFT) > b->pages)
+    {
+        return -EINVAL;
+    }
+
+    sparse = kcl_vm_private_alloc(sizeof(*sparse), private_data);
+    if (sparse == NULL)
+    {
+        KCL_DEBUG_ERROR("Out of memory when allocating sparse mapping\n");
+        return -ENOMEM;
+    }
+
+    atomic_inc(&b->ref_count);
+    sparse->header.release = kcl_vm_sparse_release;
+    sparse->pgoff = vma->vm_pgoff;
+    sparse->buffer = b;
+
+    if (readonly)
+    {
+        vma->vm_flags &= ~(VM_WRITE | VM_MAYWRITE);
+        vma->vm_page_prot = vm_get_page_prot(vma->vm_flags);
+    }
+
+    vma->vm_flags |= VM_RESERVED;
+    vma->vm_ops = &vm_sparse_ops;
+    vma->vm_private_data = sparse;
+
+    return 0;
+#else
+    return -EINVAL;
+#endif
+}
+
+/* Submission/completion rings.
+ *
+ * A ring pair lives in vmalloc_user memory mapped into the client with
+ * __KE_RING. The client posts submissions and reaps completions with plain
+ * memory accesses; the driver drains all posted submissions on a single
+ * kick with KCL_RING_Drain. The authoritative driver side indices are kept
+ * in kcl_ring_t, the client written indices are validated on every use.
+ */
+typedef struct kcl_ring_tag
+{
+    KCL_RING_Header*    shared;
+    char*               sub;                /* submission slots */
+    char*               cpl;                /* completion slots */
+    unsigned int        sub_tail;
+    unsigned int        cpl_head;
+    unsigned int        sub_entries;
+    unsigned int        sub_entry_size;
+    unsigned int        cpl_entries;
+    unsigned int        cpl_entry_size;
+    struct mutex        sub_lock;           /* serializes drains, held across the handler */
+    spinlock_t          cpl_lock;           /* serializes completions */
+    char                entry[0];           /* private copy of the drained entry */
+} kcl_ring_t;
+
+static atomic_t kcl_ring_submissions = ATOMIC_INIT(0);
+static atomic_t kcl_ring_drains = ATOMIC_INIT(0);
+
+/** \brief Create a submission/completion ring pair
+ *
+ * \param sub_entries     number of submission slots, power of two [in]
+ * \param sub_entry_size  size of a submission slot in bytes [in]
+ * \param cpl_entries     number of completion slots, power of two [in]
+ * \param cpl_entry_size  size of a completion slot in bytes [in]
+ *
+ * \return ring handle, NULL on failure
+ */
+void* ATI_API_CALL KCL_RING_Create(unsigned int sub_entries, unsigned int sub_entry_size,
+                                   unsigned int cpl_entries, unsigned int cpl_entry_size)
+{
+    kcl_ring_t* ring;
+    unsigned long sub_offset, cpl_offset, size;
+
+    if (!is_power_of_2(sub_entries) || !is_power_of_2(cpl_entries) ||
+        sub_entry_size == 0 || cpl_entry_size == 0 ||
+        sub_entry_size > PAGE_SIZE || cpl_entry_size > PAGE_SIZE)
+    {
+        return NULL;
+    }
+
+    sub_offset = L1_CACHE_ALIGN(sizeof(KCL_RING_Header));
+    cpl_offset = L1_CACHE_ALIGN(sub_offset + (unsigned long)sub_entries * sub_entry_size);
+    size = PAGE_ALIGN(cpl_offset + (unsigned long)cpl_entries * cpl_entry_size);
+
+    ring = kzalloc(sizeof(*ring) + sub_entry_size, GFP_KERNEL);
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    ring->shared = vmalloc_user(size);
+    if (ring->shared == NULL)
+    {
+        kfree(ring);
+        return NULL;
+    }
+
+    ring->sub = (char*)ring->shared + sub_offset;
+    ring->cpl = (char*)ring->shared + cpl_offset;
+    ring->sub_entries = sub_entries;
+    ring->sub_entry_size = sub_entry_size;
+    ring->cpl_entries = cpl_entries;
+    ring->cpl_entry_size = cpl_entry_size;
+    mutex_init(&ring->sub_lock);
+    spin_lock_init(&ring->cpl_lock);
+
+    ring->shared->sub_entries = sub_entries;
+    ring->shared->sub_entry_size = sub_entry_size;
+    ring->shared->sub_offset = sub_offset;
+    ring->shared->cpl_entries = cpl_entries;
+    ring->shared->cpl_entry_size = cpl_entry_size;
+    ring->shared->cpl_offset = cpl_offset;
+
+    return ring;
+}
+
+/** \brief Destroy a ring pair
+ *
+ * Existing client mappings keep the ring pages until they are unmapped.
+ *
+ * \param ring  handle returned by KCL_RING_Create [in]
+ */
+void ATI_API_CALL KCL_RING_Destroy(void* ring)
+{
+    kcl_ring_t* r = (kcl_ring_t*)ring;
+
+    if (r)
+    {
+        vfree(r->shared);
+        kfree(r);
+    }
+}
+
+/** \brief Get the map address of a ring pair
+ *
+ * \param ring  handle returned by KCL_RING_Create [in]
+ *
+ * \return offset to pass to KCL_MEM_VM_MapRegion with __KE_RING
+ */
+unsigned long ATI_API_CALL KCL_RING_GetMapAddress(void* ring)
+{
+    return (unsigned long)((kcl_ring_t*)ring)->shared;
+}
+
+/** \brief Consume the posted submissions of a ring
+ *
+ * Each entry is copied out of the shared slot before the handler sees it,
+ * so the client cannot change it while it is processed. Draining stops at
+ * the first entry the handler fails; that entry is consumed.
+ *
+ * Must be called in process context. The handler may sleep.
+ *
+ * \param ring     handle returned by KCL_RING_Create [in]
+ * \param handler  called for every submission [in]
+ * \param context  passed to handler [in]
+ * \param max      maximum number of entries to consume [in]
+ *
+ * \return number of consumed entries
+ */
+unsigned int ATI_API_CALL KCL_RING_Drain(void* ring, KCL_RING_Handler_t handler, void* context, unsigned int max)
+{
+    kcl_ring_t* r = (kcl_ring_t*)ring;
+    unsigned int head, count = 0;
+
+    mutex_lock(&r->sub_lock);
+
+    head = ACCESS_ONCE(r->shared->sub_head);
+    if (head - r->sub_tail > r->sub_entries)
+    {
+        mutex_unlock(&r->sub_lock);
+        KCL_DEBUG_ERROR("Invalid ring submission head %u\n", head);
+        return 0;
+    }
+
+    /* Read the slots only after the head that published them */
+    smp_rmb();
+
+    while (r->sub_tail != head && count < max)
+    {
+        memcpy(r->entry,
+               r->sub + (r->sub_tail & (r->sub_entries - 1)) * r->sub_entry_size,
+               r->sub_entry_size);
+        r->sub_tail++;
+        count++;
+
+        if (handler(context, r->entry))
+        {
+            break;
+        }
+    }
+
+    /* Let the client reuse the slots */
+    smp_mb();
+    r->shared->sub_tail = r->sub_tail;
+
+    mutex_unlock(&r->sub_lock);
+
+    atomic_add(count, &kcl_ring_submissions);
+    atomic_inc(&kcl_ring_drains);
+
+    return count;
+}
+
+/** \brief Post a completion to a ring
+ *
+ * May be called in interrupt context.
+ *
+ * \param ring   handle returned by KCL_RING_Create [in]
+ * \param entry  completion of cpl_entry_size bytes [in]
+ *
+ * \return 0 on success, -EAGAIN if the completion ring is full
+ */
+int ATI_API_CALL KCL_RING_Complete(void* ring, const void* entry)
+{
+    kcl_ring_t* r = (kcl_ring_t*)ring;
+    unsigned long flags;
+    unsigned int tail;
+
+    spin_lock_irqsave(&r->cpl_lock, flags);
+
+    tail = ACCESS_ONCE(r->shared->cpl_tail);
+    if (r->cpl_head - tail >= r->cpl_entries)
+    {
+        spin_unlock_irqrestore(&r->cpl_lock, flags);
+        return -EAGAIN;
+    }
+
+    memcpy(r->cpl + (r->cpl_head & (r->cpl_entries - 1)) * r->cpl_entry_size,
+           entry,
+           r->cpl_entry_size);
+    r->cpl_head++;
+
+    /* Publish the slot before the head */
+    smp_wmb();
+    r->shared->cpl_head = r->cpl_head;
+
+    spin_unlock_irqrestore(&r->cpl_lock, flags);
+
+    return 0;
+}
+
+/* Fence pages.
+ *
+ * A fence page holds the last completed sequence number of every ring and
+ * the last signaled fence of every context. It is mapped read-only into the
+ * clients with __KE_FENCE and updated from the interrupt deferred handler,
+ * so a client tests for completion with a plain load and only enters the
+ * driver when it has to sleep.
+ */
+static atomic_t kcl_fence_signals = ATOMIC_INIT(0);
+
+/** \brief Create a fence page
+ *
+ * \return fence page handle, NULL if out of memory
+ */
+void* ATI_API_CALL KCL_FENCE_Create(void)
+{
+    /* vmalloc_user memory is zeroed and may be mapped to user space */
+    return vmalloc_user(PAGE_ALIGN(sizeof(KCL_FENCE_Page)));
+}
+
+/** \brief Destroy a fence page
+ *
+ * Existing client mappings keep the page until they are unmapped.
+ *
+ * \param fence  handle returned by KCL_FENCE_Create [in]
+ */
+void ATI_API_CALL KCL_FENCE_Destroy(void* fence)
+{
+    vfree(fence);
+}
+
+/** \brief Get the map address of a fence page
+ *
+ * \param fence  handle returned by KCL_FENCE_Create [in]
+ *
+ * \return offset to pass to KCL_MEM_VM_MapRegion with __KE_FENCE
+ */
+unsigned long ATI_API_CALL KCL_FENCE_GetMapAddress(void* fence)
+{
+    return (unsigned long)fence;
+}
+
+/** \brief Publish the last completed sequence number of a ring
+ *
+ * May be called in interrupt context. The results of the completed work
+ * must be visible before the sequence number is.
+ *
+ * \param fence  handle returned by KCL_FENCE_Create [in]
+ * \param ring   ring index, below KCL_FENCE_MAX_RINGS [in]
+ * \param seqno  last completed sequence number [in]
+ */
+void ATI_API_CALL KCL_FENCE_SignalRing(void* fence, unsigned int ring, unsigned int seqno)
+{
+    if (ring < KCL_FENCE_MAX_RINGS)
+    {
+        smp_wmb();
+        ((KCL_FENCE_Page*)fence)->ring_seqno[ring] = seqno;
+        atomic_inc(&kcl_fence_signals);
+    }
+}
+
+/** \brief Publish the last signaled fence of a context
+ *
+ * See KCL_FENCE_SignalRing.
+ *
+ * \param fence    handle returned by KCL_FENCE_Create [in]
+ * \param context  context index, below KCL_FENCE_MAX_CONTEXTS [in]
+ * \param seqno    last signaled sequence number [in]
+ */
+void ATI_API_CALL KCL_FENCE_SignalContext(void* fence, unsigned int context, unsigned int seqno)
+{
+    if (context < KCL_FENCE_MAX_CONTEXTS)
+    {
+        smp_wmb();
+        ((KCL_FENCE_Page*)fence)->context_fence[context] = seqno;
+        atomic_inc(&kcl_fence_signals);
+    }
+}
+
+/* Driver VMA arenas.
+ *
+ * KCL_MEM_AllocLinearAddrInterval creates one VMA per buffer mapping and
+ * takes mmap_sem for writing each time. An arena reserves one large VMA
+ * up front; KCL_MEM_Arena_Map then places buffers inside it by only
+ * updating the arena page table, and faults are dispatched through that
+ * table. Mapping and unmapping a buffer never takes mmap_sem and does not
+ * grow the VMA count of the process.
+ *
+ * The arena VMA is VM_MIXEDMAP and the PFNs are inserted without taking
+ * page references, so the pages must stay allocated until
+ * KCL_MEM_Arena_Unmap returns. All buffers of an arena share its memory
+ * type.
+ *
+ * Buffer addresses are relative to the address the arena was created at.
+ * If the process moves any part of the arena with mremap, KCL_MEM_Arena_Map
+ * fails from then on and callers fall back to separate mappings. Buffers
+ * already mapped keep their addresses for KCL_MEM_Arena_Unmap.
+ */
+#ifdef FIREGL_MEM_ARENA
+typedef struct kcl_mem_arena_tag
+{
+    struct list_head        list;           /* on kcl_mem_arena_pending until mapped */
+    atomic_t                ref_count;      /* creator plus one per VMA */
+    struct rw_semaphore     sem;            /* page table updates vs. faults */
+    struct mm_struct*       mm;
+    struct address_space*   mapping;
+    unsigned long           pgoff;          /* file offset of the arena in pages */
+    unsigned long           start;          /* user address the arena was created at */
+    int                     moved;          /* part of the arena was moved by mremap */
+    unsigned long           pages;
+    int                     type;           /* KCL_ENUM_PageCacheType */
+    unsigned long*          bitmap;         /* allocated pages */
+    struct page*            page[0];
+} kcl_mem_arena_t;
+
+static LIST_HEAD(kcl_mem_arena_pending);
+static DEFINE_SPINLOCK(kcl_mem_arena_lock);
+static unsigned long kcl_mem_arena_next_pgoff = KCL_MEM_ARENA_PGOFF_BASE;
+
+static atomic_t kcl_mem_arena_maps = ATOMIC_INIT(0);
+static atomic_t kcl_mem_arena_faults = ATOMIC_INIT(0);
+
+static void kcl_mem_arena_put(kcl_mem_arena_t* arena)
+{
+    if (atomic_dec_and_test(&arena->ref_count))
+    {
+        vfree(arena);
+    }
+}
+
+static int do_vm_arena_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    kcl_mem_arena_t* arena = (kcl_mem_arena_t*)vma->vm_private_data;
+    unsigned long address = (unsigned long) (vmf->virtual_address);
+    unsigned long i = vmf->pgoff - arena->pgoff;
+    int ret = PAGING_FAULT_SIGBUS;
+
+    /* Index by file offset, vm_start no longer matches after mremap */
+    if (vmf->pgoff < arena->pgoff || i >= arena->pages)
+    {
+        return (PAGING_FAULT_SIGBUS);
+    }
+
+    /* Hold the table across the insertion, so KCL_MEM_Arena_Unmap cannot
+     * zap the range between the lookup and the PTE update */
+    down_read(&arena->sem);
+    if (arena->page[i])
+    {
+        ret = vm_insert_mixed(vma, address & PAGE_MASK, page_to_pfn(arena->page[i]));
+        if (ret == 0 || ret == -EBUSY)
+        {
+            ret = VM_FAULT_NOPAGE;
+        }
+        else
+        {
+            ret = (ret == -ENOMEM) ? VM_FAULT_OOM : PAGING_FAULT_SIGBUS;
+        }
+    }
+    up_read(&arena->sem);
+
+    atomic_inc(&kcl_mem_arena_faults);
+
+    return ret;
+}
+
+static int ip_vm_arena_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    TRACE_FAULT(do_vm_arena_fault, vma, vmf);
+}
+
+static void ip_vm_arena_open(struct vm_area_struct* vma)
+{
+    kcl_mem_arena_t* arena = (kcl_mem_arena_t*)vma->vm_private_data;
+
+    /* Called for the pieces of a split and for the copy made by mremap. A
+     * piece that is not at its original place was moved. */
+    if (vma->vm_start - ((vma->vm_pgoff - arena->pgoff) << PAGE_SHIFT) != arena->start)
+    {
+        arena->moved = 1;
+    }
+
+    atomic_inc(&arena->ref_count);
+}
+
+static void ip_vm_arena_close(struct vm_area_struct* vma)
+{
+    kcl_mem_arena_put((kcl_mem_arena_t*)vma->vm_private_data);
+}
+
+static struct vm_operations_struct vm_arena_ops =
+{
+    fault:   ip_vm_arena_fault,
+    open:    ip_vm_arena_open,
+    close:   ip_vm_arena_close,
+};
+
+/** \brief mmap handler for arena offsets
+ *
+ * Only accepts the mmap issued by KCL_MEM_Arena_Create for a pending arena.
+ */
+static int kcl_mem_arena_mmap(struct file* filp, struct vm_area_struct* vma)
+{
+    kcl_mem_arena_t* arena = NULL;
+    kcl_mem_arena_t* pos;
+
+    spin_lock(&kcl_mem_arena_lock);
+    list_for_each_entry(pos, &kcl_mem_arena_pending, list)
+    {
+        if (pos->pgoff == vma->vm_pgoff &&
+            pos->mm == vma->vm_mm &&
+            pos->pages == ((vma->vm_end - vma->vm_start) >> PAGE_SHIFT))
+        {
+            arena = pos;
+            list_del_init(&arena->list);
+            break;
+        }
+    }
+    spin_unlock(&kcl_mem_arena_lock);
+
+    if (arena == NULL)
+    {
+        return -EINVAL;
+    }
+
+    arena->start = vma->vm_start;
+    arena->mapping = filp->f_mapping;
+    atomic_inc(&arena->ref_count);
+
+    switch (kcl_page_cache_type(arena->type))
+    {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+        case KCL_PAGE_CACHE_WC:
+            vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+            break;
+#endif
+        case KCL_PAGE_CACHE_UC:
+            vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+            break;
+        default:
             break;
+    }
 
-        case __KE_SG:
+    /* Not inherited by children and never grown, see ip_vm_arena_open */
+    vma->vm_flags |= VM_MIXEDMAP | VM_RESERVED | VM_DONTCOPY | VM_DONTEXPAND;
+    vma->vm_ops = &vm_arena_ops;
+    vma->vm_private_data = arena;
 
-            pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+    return 0;
+}
+#endif /* FIREGL_MEM_ARENA */
 
-            vma->vm_flags |= VM_RESERVED;
+/** \brief Reserve a driver VMA arena in the current process
+ *
+ * \param file   device file the arena is mapped through [in]
+ * \param len    size of the arena in bytes [in]
+ * \param type   memory type of all buffers in the arena, see KCL_ENUM_PageCacheType [in]
+ *
+ * \return arena handle, NULL on failure or if arenas are not supported.
+ *         Callers fall back to KCL_MEM_AllocLinearAddrInterval in that case.
+ */
+void* ATI_API_CALL KCL_MEM_Arena_Create(KCL_IO_FILE_Handle file, unsigned long len, int type)
+{
+#ifdef FIREGL_MEM_ARENA
+    kcl_mem_arena_t* arena;
+    unsigned long pages = len >> PAGE_SHIFT;
 
-            //vma->vm_flags |=  VM_SHM | VM_LOCKED; /* DDDDDDDDDDon't swap */
-            //vma->vm_mm->locked_vm += pages; /* Kernel tracks aqmount of locked pages */
-            vma->vm_ops = &vm_pcie_ops;
-            break;
+    if (pages == 0)
+    {
+        return NULL;
+    }
 
-        case __KE_CTX:
-            pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
-            vma->vm_flags |= VM_LOCKED | VM_SHM | VM_RESERVED; /* Don't swap */
-            vma->vm_mm->locked_vm += pages; /* Kernel tracks aqmount of locked pages */
-            vma->vm_ops = &vm_ctx_ops;
-            break;
+    arena = vmalloc(sizeof(*arena) + pages * sizeof(arena->page[0]) + BITS_TO_LONGS(pages) * sizeof(unsigned long));
+    if (arena == NULL)
+    {
+        KCL_DEBUG_ERROR("Out of memory when allocating arena\n");
+        return NULL;
+    }
 
-        case __KE_PCI_BQS:
-            pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
-            vma->vm_flags |= VM_LOCKED | VM_SHM | VM_RESERVED; /* Don't swap */
-            vma->vm_mm->locked_vm += pages; /* Kernel tracks aqmount of locked pages */
-            vma->vm_ops = &vm_pci_bq_ops;
-            break;
+    memset(arena, 0, sizeof(*arena) + pages * sizeof(arena->page[0]) + BITS_TO_LONGS(pages) * sizeof(unsigned long));
+    INIT_LIST_HEAD(&arena->list);
+    atomic_set(&arena->ref_count, 1);
+    init_rwsem(&arena->sem);
+    arena->mm = current->mm;
+    arena->pages = pages;
+    arena->type = type;
+    arena->bitmap = (unsigned long*)&arena->page[pages];
 
-#ifdef __AGP__BUILTIN__
-        case __KE_AGP:
-            // if(dev->agp->cant_use_aperture == 1) 
-            // else
-            {
-#if defined(__i386__) && !defined(CONFIG_X86_4G)
-                if (offset >= __pa(high_memory))
-#endif
-                    vma->vm_flags |= VM_IO; /* not in core dump */
+    spin_lock(&kcl_mem_arena_lock);
+    arena->pgoff = kcl_mem_arena_next_pgoff;
+    kcl_mem_arena_next_pgoff += pages;
+    list_add(&arena->list, &kcl_mem_arena_pending);
+    spin_unlock(&kcl_mem_arena_lock);
 
-#ifdef FIREGL_USWC_SUPPORT
-                if (boot_cpu_data.x86 > 3)
-                {
-                    if (kcl_mem_pat_status != KCL_MEM_PAT_DISABLED)
-                    {
-                        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
-                    }    
-                }
-#endif                
+    KCL_MEM_AllocLinearAddrInterval(file, 0, pages << PAGE_SHIFT, arena->pgoff << PAGE_SHIFT);
 
-                if (REMAP_PAGE_RANGE(vma,offset))
-                {
-                    KCL_DEBUG_ERROR(REMAP_PAGE_RANGE_STR " failed\n");
-                    return -EAGAIN;
-                }
-#ifdef __x86_64__
-                vma->vm_flags |= VM_RESERVED;
+    spin_lock(&kcl_mem_arena_lock);
+    list_del_init(&arena->list);
+    spin_unlock(&kcl_mem_arena_lock);
+
+    if (arena->start == 0)
+    {
+        kcl_mem_arena_put(arena);
+        return NULL;
+    }
+
+    return arena;
 #else
-                vma->vm_flags |= VM_SHM | VM_RESERVED; /* Don't swap */
-#endif
-                vma->vm_ops = &vm_ops;
-            }
-            break;
-        case __KE_AGP_BQS:
-            // if(dev->agp->cant_use_aperture == 1) 
-            {
-#if defined(__i386__) && !defined(CONFIG_X86_4G)
-                if (offset >= __pa(high_memory))
+    return NULL;
 #endif
-                    vma->vm_flags |= VM_IO; /* not in core dump */
+}
 
-#ifdef FIREGL_USWC_SUPPORT
-                if (boot_cpu_data.x86 > 3)
-                {
-                    if (kcl_mem_pat_status != KCL_MEM_PAT_DISABLED)
-                    {
-                        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
-                    }   
-                }
-#endif                
+/** \brief Release an arena
+ *
+ * Unmaps the arena VMA if called in the context of the owning process. A
+ * moved arena is left to the process, its original range may be reused.
+ *
+ * \param arena  handle returned by KCL_MEM_Arena_Create [in]
+ */
+void ATI_API_CALL KCL_MEM_Arena_Destroy(void* arena)
+{
+#ifdef FIREGL_MEM_ARENA
+    kcl_mem_arena_t* a = (kcl_mem_arena_t*)arena;
 
-                if (REMAP_PAGE_RANGE(vma,offset))
-                {
-                    KCL_DEBUG_ERROR(REMAP_PAGE_RANGE_STR " failed\n");
-                    return -EAGAIN;
-                }
-#ifdef __x86_64__
-                vma->vm_flags |= VM_RESERVED;
-#else
-                vma->vm_flags |= VM_SHM | VM_RESERVED; /* Don't swap */
+    if (current->mm == a->mm && !a->moved)
+    {
+        KCL_MEM_ReleaseLinearAddrInterval(a->start, a->pages << PAGE_SHIFT);
+    }
+
+    kcl_mem_arena_put(a);
 #endif
-                vma->vm_ops = &vm_agp_bq_ops;
-            }
-            break;
-#endif /* __AGP__BUILTIN__ */
+}
 
-        case __KE_KMAP:
-		    vma->vm_flags |= VM_SHM | VM_RESERVED;
-            vma->vm_ops = &vm_kmap_ops;
-            if (readonly && (vma->vm_flags & VM_WRITE))
-            {
-                KCL_DEBUG_ERROR("ERROR: cannot map a readonly map with PROT_WRITE!\n");
-                return -EINVAL; // write not allowed - explicitly fail the map!
-            }
-            break;
+/** \brief Map a buffer into an arena
+ *
+ * \param arena      handle returned by KCL_MEM_Arena_Create [in]
+ * \param page_list  pages of the buffer [in]
+ * \param page_cnt   number of pages [in]
+ *
+ * \return user address of the buffer, 0 if the arena is full or was moved
+ */
+unsigned long ATI_API_CALL KCL_MEM_Arena_Map(void* arena, unsigned long* page_list, unsigned int page_cnt)
+{
+#ifdef FIREGL_MEM_ARENA
+    kcl_mem_arena_t* a = (kcl_mem_arena_t*)arena;
+    unsigned long i;
+    unsigned int j;
 
-         case __KE_GART_USWC:
-#ifdef FIREGL_USWC_SUPPORT         
-            if (boot_cpu_data.x86 > 3)
-            {
-                if (kcl_mem_pat_status != KCL_MEM_PAT_DISABLED)
-                {
-                    vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
-                }    
-            }
-#endif            
-            // fall through
-         case __KE_GART_CACHEABLE:
-             vma->vm_flags |= VM_RESERVED;
-             vma->vm_ops = &vm_gart_ops;
-             break;
-        default:
-            /*  This should never happen anyway! */
-            KCL_DEBUG_ERROR("kcl_vm_map: Unknown type %d\n", type);
-            return -EINVAL;
+    if (ACCESS_ONCE(a->moved))
+    {
+        return 0;
     }
 
-    if (readonly)
+    down_write(&a->sem);
+    i = bitmap_find_next_zero_area(a->bitmap, a->pages, 0, page_cnt, 0);
+    if (i >= a->pages)
     {
-        vma->vm_flags &= ~(VM_WRITE | VM_MAYWRITE);
-		pgprot_val(vma->vm_page_prot) &= ~_PAGE_RW;
+        up_write(&a->sem);
+        return 0;
     }
 
-    vma->vm_file = (struct file*)filp;    /* Needed for drm_vm_open() */
-    vma->vm_private_data = private_data;
+    bitmap_set(a->bitmap, i, page_cnt);
+    for (j = 0; j < page_cnt; j++)
+    {
+        a->page[i + j] = (struct page*)page_list[j];
+    }
+    up_write(&a->sem);
+
+    atomic_inc(&kcl_mem_arena_maps);
 
+    return a->start + (i << PAGE_SHIFT);
+#else
     return 0;
+#endif
+}
+
+/** \brief Unmap a buffer from an arena
+ *
+ * After return no CPU mapping of the buffer pages is left in the arena.
+ *
+ * \param arena     handle returned by KCL_MEM_Arena_Create [in]
+ * \param addr      address returned by KCL_MEM_Arena_Map [in]
+ * \param page_cnt  number of pages [in]
+ */
+void ATI_API_CALL KCL_MEM_Arena_Unmap(void* arena, unsigned long addr, unsigned int page_cnt)
+{
+#ifdef FIREGL_MEM_ARENA
+    kcl_mem_arena_t* a = (kcl_mem_arena_t*)arena;
+    unsigned long i = (addr - a->start) >> PAGE_SHIFT;
+
+    if (addr < a->start || i + page_cnt > a->pages)
+    {
+        return;
+    }
+
+    down_write(&a->sem);
+    unmap_mapping_range(a->mapping,
+                        (loff_t)(a->pgoff + i) << PAGE_SHIFT,
+                        (loff_t)page_cnt << PAGE_SHIFT,
+                        0);
+    memset(&a->page[i], 0, page_cnt * sizeof(a->page[0]));
+    bitmap_clear(a->bitmap, i, page_cnt);
+    up_write(&a->sem);
+#endif
 }
 
 #ifdef FIREGL_USWC_SUPPORT
@@ -6312,4 +9738,226 @@ void KCL_create_proc_entry(void *root_dir, const char *name, unsigned int access
     }
 }
 
+
+#ifdef FIREGL_IOCTL_STATS
+/** \brief Callback function for reading from /proc/ati/ioctl_stats
+ *
+ * Prints one line per ioctl command number that has been called: the
+ * command, calls, failed calls and the latency histogram summed over all
+ * CPUs. Bucket n counts calls that took [2^n, 2^(n+1)) ns.
+ *
+ * \param m     seq_file to print into [out]
+ * \param data  callback data pointer (unused) [in]
+ *
+ * \return 0
+ */
+static int firegl_ioctl_stats_proc_read(struct seq_file *m, void* data)
+{
+    kcl_ioctl_stats_t sum;
+    kcl_ioctl_stats_t* stats;
+    unsigned int nr, cpu, b;
+
+    seq_printf(m, "# enabled %d\n", kcl_ioctl_stats_enabled);
+    seq_printf(m, "# %-8s %10s %8s", "cmd", "calls", "errors");
+    for (b = 0; b < KCL_IOCTL_STATS_BUCKETS; b++)
+    {
+        seq_printf(m, " %7s%-2u", "2^", b);
+    }
+    seq_printf(m, "\n");
+
+    if (kcl_ioctl_stats == NULL)
+    {
+        return 0;
+    }
+
+    for (nr = 0; nr < KCL_IOCTL_STATS_CMDS; nr++)
+    {
+        memset(&sum, 0, sizeof(sum));
+        for_each_possible_cpu(cpu)
+        {
+            stats = per_cpu_ptr(kcl_ioctl_stats, cpu) + nr;
+            if (stats->calls)
+            {
+                sum.cmd = stats->cmd;
+            }
+            sum.calls += stats->calls;
+            sum.errors += stats->errors;
+            for (b = 0; b < KCL_IOCTL_STATS_BUCKETS; b++)
+            {
+                sum.hist[b] += stats->hist[b];
+            }
+        }
+
+        if (sum.calls == 0)
+        {
+            continue;
+        }
+
+        seq_printf(m, "0x%08x %10u %8u", sum.cmd, sum.calls, sum.errors);
+        for (b = 0; b < KCL_IOCTL_STATS_BUCKETS; b++)
+        {
+            seq_printf(m, " %9u", sum.hist[b]);
+        }
+        seq_printf(m, "\n");
+    }
+
+    return 0;
+}
+
+/** \brief Callback function for writing to /proc/ati/ioctl_stats
+ *
+ * "0" disables and "1" enables the accounting, anything else resets all
+ * counters. The reset clears the slots of other CPUs without synchronizing
+ * with them. A call accounted on another CPU at the same time may be lost or
+ * may write back a count from before the reset, so the counters are
+ * approximate after a reset.
+ *
+ * \return number of bytes consumed
+ */
+static ssize_t firegl_ioctl_stats_proc_write(struct file *file, const char __user *buffer,
+                                             size_t count, loff_t *ppos)
+{
+    unsigned int cpu;
+    char c = 0;
+
+    if (count && get_user(c, buffer))
+    {
+        return -EFAULT;
+    }
+
+    if (c == '0')
+    {
+        kcl_ioctl_stats_enabled = 0;
+    }
+    else if (c == '1')
+    {
+        kcl_ioctl_stats_enabled = 1;
+    }
+    else if (kcl_ioctl_stats)
+    {
+        for_each_possible_cpu(cpu)
+        {
+            memset(per_cpu_ptr(kcl_ioctl_stats, cpu), 0,
+                   sizeof(kcl_ioctl_stats_t) * KCL_IOCTL_STATS_CMDS);
+        }
+    }
+
+    return count;
+}
+#endif
+
+/** \brief Callback function for reading from /proc/ati/kcl_stats
+ *
+ * Prints the counters maintained by the kernel compatibility layer, one
+ * "name value" pair per line.
+ *
+ * \param buf      buffer to write into [out]
+ * \param start    start of new output within the buffer [out]
+ * \param offset   offset to start reading from (only 0 is supported) [in]
+ * \param request  number of bytes to be read [in]
+ * \param eof      indicate end-of-file [out]
+ * \param data     callback data pointer (unused) [in]
+ *
+ * \return number of bytes written
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+static int firegl_kcl_stats_proc_read(char *buf, char **start, kcl_off_t offset,
+                                      int request, int* eof, void* data)
+#else
+static int firegl_kcl_stats_proc_read(struct seq_file *m, void* data)
+#endif
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+    int len = 0;    // For ProcFS: fill buf from the beginning
+
+    if (offset > 0) 
+    {
+        return 0; /* no partial requests */
+    }
+
+    *start = buf;
+    *eof = 1;
+
+#define KCL_STATS_PRINT(fmt, arg...) \
+    len += snprintf(buf + len, (request > len) ? (request - len) : 0, fmt, ##arg)
+#else
+#define KCL_STATS_PRINT(fmt, arg...) seq_printf(m, fmt, ##arg)
+#endif
+
+    KCL_STATS_PRINT("page_cache_batch_commits %d\n", atomic_read(&kcl_page_cache_batch_commits));
+    KCL_STATS_PRINT("page_cache_attr_calls_avoided %d\n", atomic_read(&kcl_page_cache_attr_calls_avoided));
+    KCL_STATS_PRINT("vm_page_cache_misses %d\n", atomic_read(&kcl_vm_page_cache_misses));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    KCL_STATS_PRINT("vm_aperture_faults %d\n", atomic_read(&kcl_vm_aperture_faults));
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    KCL_STATS_PRINT("shm_dirty_faults %d\n", atomic_read(&kcl_shm_dirty_faults));
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+    KCL_STATS_PRINT("sparse_faults %d\n", atomic_read(&kcl_sparse_faults));
+    KCL_STATS_PRINT("sparse_resident_pages %d\n", atomic_read(&kcl_sparse_resident_pages));
+#endif
+#ifdef FIREGL_MEM_ARENA
+    KCL_STATS_PRINT("arena_maps %d\n", atomic_read(&kcl_mem_arena_maps));
+    KCL_STATS_PRINT("arena_faults %d\n", atomic_read(&kcl_mem_arena_faults));
+#endif
+    KCL_STATS_PRINT("asyncio_sema_in_use %d\n", atomic_read(&kcl_asyncio_sema_in_use));
+    KCL_STATS_PRINT("asyncio_sema_peak %d\n", atomic_read(&kcl_asyncio_sema_peak));
+    KCL_STATS_PRINT("asyncio_sema_allocs %d\n", atomic_read(&kcl_asyncio_sema_allocs));
+    KCL_STATS_PRINT("asyncio_sema_failures %d\n", atomic_read(&kcl_asyncio_sema_failures));
+    KCL_STATS_PRINT("asyncio_sema_capacity %u\n", fireglAsyncioChunkCount * FIREGL_ASYNCIO_MAX_SEMA);
+    KCL_STATS_PRINT("asyncio_bulk_reads %d\n", atomic_read(&kcl_asyncio_bulk_reads));
+    KCL_STATS_PRINT("asyncio_bulk_read_msgs %d\n", atomic_read(&kcl_asyncio_bulk_read_msgs));
+    KCL_STATS_PRINT("asyncio_vec_writes %d\n", atomic_read(&kcl_asyncio_vec_writes));
+    KCL_STATS_PRINT("asyncio_vec_write_msgs %d\n", atomic_read(&kcl_asyncio_vec_write_msgs));
+#if defined(KCL_OSCONFIG_IOCTL_COMPAT) && defined(__x86_64__)
+    KCL_STATS_PRINT("compat_table_calls %ld\n", atomic_long_read(&kcl_compat_table_calls));
+    KCL_STATS_PRINT("compat_table_avg_ns %ld\n",
+                    atomic_long_read(&kcl_compat_table_calls) ?
+                    atomic_long_read(&kcl_compat_table_ns) / atomic_long_read(&kcl_compat_table_calls) : 0);
+    KCL_STATS_PRINT("compat_legacy_calls %ld\n", atomic_long_read(&kcl_compat_legacy_calls));
+    KCL_STATS_PRINT("compat_legacy_avg_ns %ld\n",
+                    atomic_long_read(&kcl_compat_legacy_calls) ?
+                    atomic_long_read(&kcl_compat_legacy_ns) / atomic_long_read(&kcl_compat_legacy_calls) : 0);
+#endif
+    KCL_STATS_PRINT("ioctl_batches %d\n", atomic_read(&kcl_ioctl_batches));
+    KCL_STATS_PRINT("ioctl_batch_entries %d\n", atomic_read(&kcl_ioctl_batch_entries));
+    KCL_STATS_PRINT("fence_signals %d\n", atomic_read(&kcl_fence_signals));
+    KCL_STATS_PRINT("ring_submissions %d\n", atomic_read(&kcl_ring_submissions));
+    KCL_STATS_PRINT("ring_drains %d\n", atomic_read(&kcl_ring_drains));
+    KCL_STATS_PRINT("user_wc_copy_bytes %ld\n", atomic_long_read(&kcl_user_wc_bytes));
+    KCL_STATS_PRINT("user_wc_copy_us %ld\n", atomic_long_read(&kcl_user_wc_us));
+    KCL_STATS_PRINT("user_wc_copy_mbps %ld\n",
+                    atomic_long_read(&kcl_user_wc_us) ?
+                    atomic_long_read(&kcl_user_wc_bytes) / atomic_long_read(&kcl_user_wc_us) : 0);
+    KCL_STATS_PRINT("gart_dma32_allocs %d\n", atomic_read(&kcl_gart_dma32_allocs));
+    KCL_STATS_PRINT("dma_bytes_above_mask %ld\n", atomic_long_read(&kcl_dma_bytes_above_mask));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+    KCL_STATS_PRINT("sg_maps %d\n", atomic_read(&kcl_sg_maps));
+    KCL_STATS_PRINT("sg_pages %d\n", atomic_read(&kcl_sg_pages));
+    KCL_STATS_PRINT("sg_segments %d\n", atomic_read(&kcl_sg_segments));
+#endif
+#if defined(__x86_64__) && !defined(ESX)
+    {
+        KCL_PCI_DmaPoolStats dma_stats;
+
+        KCL_PCI_GetDmaPoolStats(&dma_stats);
+        KCL_STATS_PRINT("dma_pool_allocs %lu\n", dma_stats.pool_allocs);
+        KCL_STATS_PRINT("dma_pool_frees %lu\n", dma_stats.pool_frees);
+        KCL_STATS_PRINT("dma_large_allocs %lu\n", dma_stats.large_allocs);
+        KCL_STATS_PRINT("dma_large_frees %lu\n", dma_stats.large_frees);
+        KCL_STATS_PRINT("dma_pool_bytes_requested %lu\n", dma_stats.pool_bytes_requested);
+        KCL_STATS_PRINT("dma_pool_bytes_used %lu\n", dma_stats.pool_bytes_used);
+    }
+#endif
+
+#undef KCL_STATS_PRINT
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+    return (len > request) ? request : len;
+#else
+    return 0;
+#endif
+}
+
 #endif /* __KERNEL__ */
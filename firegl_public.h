@@ -323,6 +323,15 @@ typedef enum
     KCL_KERNEL_CONF_PARAM_NUM
 } KCL_ENUM_KernelConfigParam;
 
+/* Memory types accepted by KCL_SetPageCache and KCL_SetPageCache_Array.
+ * The values of UC and WB match the old boolean "enable" argument. */
+typedef enum
+{
+    KCL_PAGE_CACHE_UC = 0,
+    KCL_PAGE_CACHE_WB = 1,
+    KCL_PAGE_CACHE_WC = 2
+} KCL_ENUM_PageCacheType;
+
 
 typedef struct {
 	unsigned long totalram;		// Total usable main memory size 
@@ -351,6 +360,9 @@ extern unsigned long long ATI_API_CALL KCL_MapVirtualToPhysical(KCL_PCI_DevHandl
 extern void          ATI_API_CALL KCL_UnmapVirtualToPhysical(KCL_PCI_DevHandle pdev, unsigned long long bus_addr, unsigned long size);
 extern unsigned long ATI_API_CALL KCL_MapPageToPfn(KCL_PCI_DevHandle pdev, void* page);
 extern void          ATI_API_CALL KCL_UnmapPageToPfn(KCL_PCI_DevHandle pdev, unsigned long long bus_addr);
+extern void*         ATI_API_CALL KCL_MapPageListToSg(KCL_PCI_DevHandle pdev, void** page_list, unsigned int page_cnt, unsigned int* seg_cnt);
+extern unsigned int  ATI_API_CALL KCL_GetSgSegments(void* handle, unsigned long long* bus_addr, unsigned int* length, unsigned int seg_cnt);
+extern void          ATI_API_CALL KCL_UnmapSg(KCL_PCI_DevHandle pdev, void* handle);
 extern void*         ATI_API_CALL KCL_ConvertPageToKernelAddress(void* page);
 extern unsigned int  ATI_API_CALL KCL_IsPageInHighMem(void* page);
 
@@ -367,6 +379,11 @@ extern void          ATI_API_CALL KCL_UnlockMemPage(void* pt);
 extern int           ATI_API_CALL KCL_KernelConfigParamIsDefined(KCL_ENUM_KernelConfigParam param);
 extern int           ATI_API_CALL KCL_SetPageCache(void* virt, int pages,int enable);
 extern int           ATI_API_CALL KCL_SetPageCache_Array(unsigned long *pt, int pages, int enable);
+extern void*         ATI_API_CALL KCL_PageCacheBatch_Begin(void);
+extern int           ATI_API_CALL KCL_PageCacheBatch_Add(void* batch, unsigned long *pt, int pages, int enable);
+extern int           ATI_API_CALL KCL_PageCacheBatch_AddRange(void* batch, void* virt, int pages, int enable);
+extern int           ATI_API_CALL KCL_PageCacheBatch_Commit(void* batch);
+extern void          ATI_API_CALL KCL_PageCacheBatch_Abort(void* batch);
 extern void          ATI_API_CALL KCL_AtomicInc(KCL_TYPE_Atomic* v);
 extern void          ATI_API_CALL KCL_AtomicDec(KCL_TYPE_Atomic* v);
 extern void          ATI_API_CALL KCL_AtomicAdd(KCL_TYPE_Atomic* v, int val);
@@ -502,6 +519,7 @@ int ATI_API_CALL kcl_vsnprintf(char *buf, size_t size, const char *fmt, va_list
 
 extern int ATI_API_CALL KCL_CopyFromUserSpace(void* to, const void* from, kcl_size_t size);
 extern int ATI_API_CALL KCL_CopyToUserSpace(void* to, const void* from, kcl_size_t size);
+extern unsigned long ATI_API_CALL KCL_CopyFromUserToWC(void* to, const void* from, kcl_size_t size);
 
 extern void* ATI_API_CALL KCL_MEM_SmallBufferAlloc(kcl_size_t size);
 extern void* ATI_API_CALL KCL_MEM_SmallBufferAllocAtomic(kcl_size_t size);
@@ -530,6 +548,10 @@ extern void ATI_API_CALL KCL_UnlockUserPages(unsigned long* page_list, unsigned
 extern int ATI_API_CALL KCL_TestAndClearPageDirtyFlag(unsigned long virtual_addr, unsigned int page_size);
 extern unsigned long ATI_API_CALL KCL_MEM_AllocLinearAddrInterval(KCL_IO_FILE_Handle  file, unsigned long addr, unsigned long len, unsigned long pgoff);
 extern int ATI_API_CALL KCL_MEM_ReleaseLinearAddrInterval(unsigned long addr, unsigned long len);
+extern void* ATI_API_CALL KCL_MEM_Arena_Create(KCL_IO_FILE_Handle file, unsigned long len, int type);
+extern void ATI_API_CALL KCL_MEM_Arena_Destroy(void* arena);
+extern unsigned long ATI_API_CALL KCL_MEM_Arena_Map(void* arena, unsigned long* page_list, unsigned int page_cnt);
+extern void ATI_API_CALL KCL_MEM_Arena_Unmap(void* arena, unsigned long addr, unsigned int page_cnt);
 extern void* ATI_API_CALL KCL_MEM_MapPageList(unsigned long *pagelist, unsigned int count);
 #ifdef FIREGL_USWC_SUPPORT
 extern void* ATI_API_CALL KCL_MEM_MapPageListWc(unsigned long *pagelist, unsigned int count);
@@ -564,6 +586,35 @@ extern void ATI_API_CALL KCL_DisableMSI(void* context);
 
 /*****************************************************************************/
 
+/* Command numbers of the ioctls handled by the KCL before the core
+ * dispatch. The DRM core commands end below 0x40 and the driver commands
+ * use 0x40 to 0x79, see DRM_COMMAND_BASE in drm.h. */
+#define KCL_IOCTL_NR_BASE               0x80
+
+/* Batch ioctl, executes many driver ioctls in a single kernel entry. */
+typedef struct
+{
+    unsigned int cmd;                       /* ioctl command */
+    int result;                             /* return value of the command [out] */
+    unsigned long long arg;                 /* ioctl argument */
+} KCL_IOCTL_BatchEntry;
+
+typedef struct
+{
+    unsigned long long entries;             /* user pointer to KCL_IOCTL_BatchEntry[count] */
+    unsigned int count;
+    unsigned int flags;                     /* KCL_IOCTL_BATCH_* */
+    unsigned int completed;                 /* number of executed entries [out] */
+    unsigned int pad;
+} KCL_IOCTL_BatchHeader;
+
+#define KCL_IOCTL_BATCH_STOP_ON_ERROR   0x1
+
+#define KCL_IOCTL_BATCH                 _IOWR('d', KCL_IOCTL_NR_BASE + 0x00, KCL_IOCTL_BatchHeader)
+#define KCL_IOCTL_BATCH_MAX_ENTRIES     1024
+
+/*****************************************************************************/
+
 extern void* ATI_API_CALL KCL_MEM_VM_GetRegionFilePrivateData(struct vm_area_struct* vma);
 extern void* ATI_API_CALL KCL_MEM_VM_GetRegionPrivateData(struct vm_area_struct* vma);
 extern unsigned long ATI_API_CALL KCL_MEM_VM_GetRegionStart(struct vm_area_struct* vma);
@@ -581,7 +632,9 @@ enum kcl_vm_maptype
     __KE_KMAP,
     __KE_GART_USWC,
     __KE_GART_CACHEABLE,
-    __KE_ADPT_REG
+    __KE_ADPT_REG,
+    __KE_RING,
+    __KE_FENCE
 };
 extern char* ATI_API_CALL KCL_MEM_VM_GetRegionFlagsStr(struct vm_area_struct* vma, char* buf);
 extern char* ATI_API_CALL KCL_MEM_VM_GetRegionProtFlagsStr(struct vm_area_struct* vma, char* buf);
@@ -595,6 +648,88 @@ extern int ATI_API_CALL KCL_MEM_VM_MapRegion(KCL_IO_FILE_Handle filp,
                                     enum kcl_vm_maptype type,
                                     int readonly,
                                     void *private_data);
+extern int ATI_API_CALL KCL_MEM_VM_MapRegionPfn(KCL_IO_FILE_Handle filp,
+                                    struct vm_area_struct* vma,
+                                    unsigned long long offset,
+                                    enum kcl_vm_maptype type,
+                                    int readonly,
+                                    void *private_data);
+extern int ATI_API_CALL KCL_MEM_VM_MapRegionAperture(KCL_IO_FILE_Handle filp,
+                                    struct vm_area_struct* vma,
+                                    unsigned long long offset,
+                                    enum kcl_vm_maptype type,
+                                    int readonly,
+                                    void *private_data);
+extern int ATI_API_CALL KCL_MEM_VM_MapRegionTracked(KCL_IO_FILE_Handle filp,
+                                    struct vm_area_struct* vma,
+                                    unsigned long long offset,
+                                    int readonly,
+                                    void *private_data,
+                                    void *tracker);
+extern void* ATI_API_CALL KCL_MEM_DirtyTracker_Create(unsigned int pages);
+extern void ATI_API_CALL KCL_MEM_DirtyTracker_Destroy(void* tracker);
+extern unsigned int ATI_API_CALL KCL_MEM_DirtyTracker_Collect(void* tracker, unsigned long* bitmap, unsigned int pages);
+
+/* Shared header of a submission/completion ring pair, see KCL_RING_Create.
+ * The client and the driver write separate cache lines. */
+typedef struct
+{
+    /* Written by the client */
+    volatile unsigned int sub_head;         /* next submission slot to fill */
+    volatile unsigned int cpl_tail;         /* next completion slot to read */
+    unsigned int pad0[14];
+    /* Written by the driver */
+    volatile unsigned int sub_tail;         /* next submission slot to consume */
+    volatile unsigned int cpl_head;         /* next completion slot to fill */
+    unsigned int pad1[14];
+    /* Layout, constant after creation */
+    unsigned int sub_entries;
+    unsigned int sub_entry_size;
+    unsigned int sub_offset;                /* byte offset of the submission slots */
+    unsigned int cpl_entries;
+    unsigned int cpl_entry_size;
+    unsigned int cpl_offset;                /* byte offset of the completion slots */
+} KCL_RING_Header;
+
+typedef int (*KCL_RING_Handler_t)(void* context, const void* entry);
+
+extern void* ATI_API_CALL KCL_RING_Create(unsigned int sub_entries, unsigned int sub_entry_size,
+                                          unsigned int cpl_entries, unsigned int cpl_entry_size);
+extern void ATI_API_CALL KCL_RING_Destroy(void* ring);
+extern unsigned long ATI_API_CALL KCL_RING_GetMapAddress(void* ring);
+extern unsigned int ATI_API_CALL KCL_RING_Drain(void* ring, KCL_RING_Handler_t handler, void* context, unsigned int max);
+extern int ATI_API_CALL KCL_RING_Complete(void* ring, const void* entry);
+
+/* Read-only fence page, see KCL_FENCE_Create. Values are 32-bit sequence
+ * numbers, clients compare them with wrap around. */
+#define KCL_FENCE_MAX_RINGS     16
+#define KCL_FENCE_MAX_CONTEXTS  ((PAGE_SIZE_4K / sizeof(unsigned int)) - KCL_FENCE_MAX_RINGS)
+
+typedef struct
+{
+    volatile unsigned int ring_seqno[KCL_FENCE_MAX_RINGS];        /* last completed per ring */
+    volatile unsigned int context_fence[KCL_FENCE_MAX_CONTEXTS];  /* last signaled per context */
+} KCL_FENCE_Page;
+
+extern void* ATI_API_CALL KCL_FENCE_Create(void);
+extern void ATI_API_CALL KCL_FENCE_Destroy(void* fence);
+extern unsigned long ATI_API_CALL KCL_FENCE_GetMapAddress(void* fence);
+extern void ATI_API_CALL KCL_FENCE_SignalRing(void* fence, unsigned int ring, unsigned int seqno);
+extern void ATI_API_CALL KCL_FENCE_SignalContext(void* fence, unsigned int context, unsigned int seqno);
+
+typedef void (*KCL_SPARSE_BindCallback_t)(void* context, unsigned int page_index, void* page);
+
+extern void* ATI_API_CALL KCL_MEM_Sparse_Create(unsigned int pages, KCL_SPARSE_BindCallback_t bind, void* context);
+extern void ATI_API_CALL KCL_MEM_Sparse_Destroy(void* buffer);
+extern int ATI_API_CALL KCL_MEM_Sparse_Commit(void* buffer, unsigned int first, unsigned int count);
+extern void* ATI_API_CALL KCL_MEM_Sparse_GetPage(void* buffer, unsigned int index);
+extern unsigned long ATI_API_CALL KCL_MEM_Sparse_GetResidentSize(void* buffer);
+extern int ATI_API_CALL KCL_MEM_VM_MapRegionSparse(KCL_IO_FILE_Handle filp,
+                                    struct vm_area_struct* vma,
+                                    unsigned long long offset,
+                                    int readonly,
+                                    void *private_data,
+                                    void *buffer);
 
 /*****************************************************************************/
 
@@ -31,6 +31,9 @@
  */
 
 #include <linux/version.h>
+#include <linux/errno.h>
+#include <linux/ioctl.h>
+#include <linux/string.h>
 #include <asm/uaccess.h>
 
 #ifdef __x86_64__
@@ -231,4 +234,211 @@ void* ATI_API_CALL KCL_IOCTL_AllocUserSpace32(long size)
     return (void *)ret;
 }
 
+/* Registered translations, indexed by command number. The commands of the
+ * driver share one ioctl type, so the number alone identifies them. */
+#define KCL_IOCTL_COMPAT_TABLE_SIZE (_IOC_NRMASK + 1)
+
+static const KCL_IOCTL_CompatCmd* kcl_ioctl_compat_table[KCL_IOCTL_COMPAT_TABLE_SIZE];
+
+/* Width of a field in the 32-bit and in the native layout, 0 if the type
+ * is unknown */
+static void kcl_ioctl_compat_width(const KCL_IOCTL_CompatField* f,
+                                   unsigned int* width32,
+                                   unsigned int* width64)
+{
+    switch (f->type)
+    {
+    case KCL_IOCTL_COMPAT_U8:
+        *width32 = *width64 = sizeof(u8);
+        break;
+    case KCL_IOCTL_COMPAT_U16:
+        *width32 = *width64 = sizeof(u16);
+        break;
+    case KCL_IOCTL_COMPAT_U32:
+        *width32 = *width64 = sizeof(u32);
+        break;
+    case KCL_IOCTL_COMPAT_U64:
+        *width32 = *width64 = sizeof(u64);
+        break;
+    case KCL_IOCTL_COMPAT_S32_LONG:
+        *width32 = sizeof(s32);
+        *width64 = sizeof(long);
+        break;
+    case KCL_IOCTL_COMPAT_U32_ULONG:
+        *width32 = sizeof(u32);
+        *width64 = sizeof(unsigned long);
+        break;
+    case KCL_IOCTL_COMPAT_PTR:
+        *width32 = sizeof(compat_uptr_t);
+        *width64 = sizeof(void __user*);
+        break;
+    case KCL_IOCTL_COMPAT_BYTES:
+        *width32 = *width64 = f->len;
+        break;
+    default:
+        *width32 = *width64 = 0;
+        break;
+    }
+}
+
+/** \brief Register a table driven 32-on-64 translation
+ *  The entry must stay valid until unregistered. Registration is expected
+ *  while no 32-bit client can issue the command, i.e. at initialization.
+ *  Every field must lie within the argument size encoded in both commands.
+ *  \param entry [in] Command translation
+ *  \return Zero on success, negative error code otherwise
+ */
+int ATI_API_CALL KCL_IOCTL_RegisterCompat(const KCL_IOCTL_CompatCmd* entry)
+{
+    unsigned int nr = _IOC_NR(entry->cmd32);
+    unsigned int size32 = _IOC_SIZE(entry->cmd32);
+    unsigned int size64 = _IOC_SIZE(entry->cmd64);
+    unsigned int width32, width64;
+    unsigned int i;
+
+    if (_IOC_NR(entry->cmd64) != nr || size32 == 0 || size64 == 0)
+    {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < entry->field_cnt; i++)
+    {
+        const KCL_IOCTL_CompatField* f = &entry->fields[i];
+
+        kcl_ioctl_compat_width(f, &width32, &width64);
+        if (width32 == 0 || width64 == 0 ||
+            f->off32 + width32 > size32 ||
+            f->off64 + width64 > size64)
+        {
+            return -EINVAL;
+        }
+    }
+
+    if (kcl_ioctl_compat_table[nr] && kcl_ioctl_compat_table[nr]->cmd32 != entry->cmd32)
+    {
+        return -EBUSY;
+    }
+
+    kcl_ioctl_compat_table[nr] = entry;
+    return 0;
+}
+
+/** \brief Unregister a table driven 32-on-64 translation
+ *  \param cmd32 [in] 32-bit IOCTL ID
+ */
+void ATI_API_CALL KCL_IOCTL_UnregisterCompat(unsigned int cmd32)
+{
+    unsigned int nr = _IOC_NR(cmd32);
+
+    if (kcl_ioctl_compat_table[nr] && kcl_ioctl_compat_table[nr]->cmd32 == cmd32)
+    {
+        kcl_ioctl_compat_table[nr] = NULL;
+    }
+}
+
+/** \brief Look up the translation of a 32-bit IOCTL
+ *  \param cmd32 [in] 32-bit IOCTL ID
+ *  \return Translation, NULL if the command is not table driven
+ */
+const KCL_IOCTL_CompatCmd* ATI_API_CALL KCL_IOCTL_FindCompat(unsigned int cmd32)
+{
+    const KCL_IOCTL_CompatCmd* entry = kcl_ioctl_compat_table[_IOC_NR(cmd32)];
+
+    return (entry && entry->cmd32 == cmd32) ? entry : NULL;
+}
+
+/** \brief Convert a 32-bit argument struct into the native struct
+ *  \param entry [in] Command translation
+ *  \param dst64 [out] Native struct, zeroed by the caller
+ *  \param src32 [in] 32-bit struct
+ */
+void ATI_API_CALL KCL_IOCTL_CompatToNative(const KCL_IOCTL_CompatCmd* entry,
+                                           void* dst64,
+                                           const void* src32)
+{
+    const KCL_IOCTL_CompatField* f;
+    unsigned int i;
+
+    for (i = 0, f = entry->fields; i < entry->field_cnt; i++, f++)
+    {
+        const char* s = (const char*)src32 + f->off32;
+        char* d = (char*)dst64 + f->off64;
+
+        switch (f->type)
+        {
+        case KCL_IOCTL_COMPAT_U8:
+            *(u8*)d = *(const u8*)s;
+            break;
+        case KCL_IOCTL_COMPAT_U16:
+            *(u16*)d = *(const u16*)s;
+            break;
+        case KCL_IOCTL_COMPAT_U32:
+            *(u32*)d = *(const u32*)s;
+            break;
+        case KCL_IOCTL_COMPAT_U64:
+            *(u64*)d = *(const u64*)s;
+            break;
+        case KCL_IOCTL_COMPAT_S32_LONG:
+            *(long*)d = *(const s32*)s;
+            break;
+        case KCL_IOCTL_COMPAT_U32_ULONG:
+            *(unsigned long*)d = *(const u32*)s;
+            break;
+        case KCL_IOCTL_COMPAT_PTR:
+            *(void __user**)d = compat_ptr(*(const compat_uptr_t*)s);
+            break;
+        case KCL_IOCTL_COMPAT_BYTES:
+            memcpy(d, s, f->len);
+            break;
+        }
+    }
+}
+
+/** \brief Convert a native argument struct back into the 32-bit struct
+ *  \param entry [in] Command translation
+ *  \param dst32 [out] 32-bit struct
+ *  \param src64 [in] Native struct
+ */
+void ATI_API_CALL KCL_IOCTL_NativeToCompat(const KCL_IOCTL_CompatCmd* entry,
+                                           void* dst32,
+                                           const void* src64)
+{
+    const KCL_IOCTL_CompatField* f;
+    unsigned int i;
+
+    for (i = 0, f = entry->fields; i < entry->field_cnt; i++, f++)
+    {
+        const char* s = (const char*)src64 + f->off64;
+        char* d = (char*)dst32 + f->off32;
+
+        switch (f->type)
+        {
+        case KCL_IOCTL_COMPAT_U8:
+            *(u8*)d = *(const u8*)s;
+            break;
+        case KCL_IOCTL_COMPAT_U16:
+            *(u16*)d = *(const u16*)s;
+            break;
+        case KCL_IOCTL_COMPAT_U32:
+            *(u32*)d = *(const u32*)s;
+            break;
+        case KCL_IOCTL_COMPAT_U64:
+            *(u64*)d = *(const u64*)s;
+            break;
+        case KCL_IOCTL_COMPAT_S32_LONG:
+            *(s32*)d = (s32)*(const long*)s;
+            break;
+        case KCL_IOCTL_COMPAT_U32_ULONG:
+            *(u32*)d = (u32)*(const unsigned long*)s;
+            break;
+        case KCL_IOCTL_COMPAT_PTR:
+            *(compat_uptr_t*)d = ptr_to_compat(*(void __user* const*)s);
+            break;
+        case KCL_IOCTL_COMPAT_BYTES:
+            memcpy(d, s, f->len);
+            break;
+        }
+    }
+}
+
 #endif // __x86_64__
@@ -62,6 +62,58 @@ void ATI_API_CALL KCL_IOCTL_UnregisterConversion32(unsigned int cmd);
 
 void* ATI_API_CALL KCL_IOCTL_AllocUserSpace32(long size);
 
+/* Table driven 32-on-64 argument translation.
+ *
+ * A command registered with KCL_IOCTL_RegisterCompat has its 32-bit argument
+ * struct converted field by field into the native struct in kernel memory.
+ * Fields not listed are zero in the native struct and left untouched in the
+ * 32-bit struct. Registration fails if a field does not fit in the argument
+ * size of either command. The native handler runs on the kernel copy under
+ * KERNEL_DS, so every user address in the struct must be a
+ * KCL_IOCTL_COMPAT_PTR field, which can only hold addresses below 4GB.
+ */
+typedef enum
+{
+    KCL_IOCTL_COMPAT_U8 = 0,
+    KCL_IOCTL_COMPAT_U16,
+    KCL_IOCTL_COMPAT_U32,
+    KCL_IOCTL_COMPAT_U64,       /* 4-byte aligned in 32-bit layout */
+    KCL_IOCTL_COMPAT_S32_LONG,  /* int <-> long, sign extended */
+    KCL_IOCTL_COMPAT_U32_ULONG, /* unsigned int <-> unsigned long */
+    KCL_IOCTL_COMPAT_PTR,       /* compat_uptr_t <-> void __user* */
+    KCL_IOCTL_COMPAT_BYTES,     /* len bytes copied as is */
+} KCL_IOCTL_CompatFieldType;
+
+typedef struct
+{
+    unsigned short off32;       /* offset in the 32-bit struct */
+    unsigned short off64;       /* offset in the native struct */
+    unsigned short type;        /* KCL_IOCTL_CompatFieldType */
+    unsigned short len;         /* size for KCL_IOCTL_COMPAT_BYTES */
+} KCL_IOCTL_CompatField;
+
+typedef struct
+{
+    unsigned int cmd32;         /* command issued by 32-bit clients */
+    unsigned int cmd64;         /* native command it is executed as */
+    unsigned int field_cnt;
+    const KCL_IOCTL_CompatField* fields;
+} KCL_IOCTL_CompatCmd;
+
+int ATI_API_CALL KCL_IOCTL_RegisterCompat(const KCL_IOCTL_CompatCmd* entry);
+
+void ATI_API_CALL KCL_IOCTL_UnregisterCompat(unsigned int cmd32);
+
+const KCL_IOCTL_CompatCmd* ATI_API_CALL KCL_IOCTL_FindCompat(unsigned int cmd32);
+
+void ATI_API_CALL KCL_IOCTL_CompatToNative(const KCL_IOCTL_CompatCmd* entry,
+                                           void* dst64,
+                                           const void* src32);
+
+void ATI_API_CALL KCL_IOCTL_NativeToCompat(const KCL_IOCTL_CompatCmd* entry,
+                                           void* dst32,
+                                           const void* src64);
+
 #endif // __x86_64__
 
 #endif
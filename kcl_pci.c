@@ -36,6 +36,11 @@
 #include <linux/autoconf.h>
 #endif
 #include <linux/pci.h>
+#include <linux/dmapool.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 
 #include "kcl_config.h"
 #include "kcl_type.h"
@@ -309,6 +314,210 @@ void ATI_API_CALL KCL_PCI_DisableDevice(KCL_PCI_DevHandle dev)
 }
 
 #if defined(__x86_64__)
+/* Small coherent allocations are served from per-device dma_pools, one per
+ * power of two size class. They share pages and IOMMU mappings instead of
+ * taking at least a page each. Larger requests go to pci_alloc_consistent. */
+#define KCL_PCI_DMA_POOL_MIN_SHIFT  6       /* 64 bytes */
+#define KCL_PCI_DMA_POOL_MAX_SHIFT  11      /* 2048 bytes */
+#define KCL_PCI_DMA_POOL_CLASSES    (KCL_PCI_DMA_POOL_MAX_SHIFT - KCL_PCI_DMA_POOL_MIN_SHIFT + 1)
+
+typedef struct kcl_pci_dma_pools_tag
+{
+    struct list_head    list;
+    struct pci_dev*     pdev;
+    struct dma_pool*    pool[KCL_PCI_DMA_POOL_CLASSES];
+} kcl_pci_dma_pools_t;
+
+static const char* kcl_pci_dma_pool_names[KCL_PCI_DMA_POOL_CLASSES] =
+{
+    "fglrx_dma64", "fglrx_dma128", "fglrx_dma256",
+    "fglrx_dma512", "fglrx_dma1024", "fglrx_dma2048",
+};
+
+/* Every pooled block is recorded with the pool it came from, so the free
+ * path does not depend on whether the device has pools at free time */
+#define KCL_PCI_DMA_BLOCK_HASH_BITS 8
+
+typedef struct kcl_pci_dma_block_tag
+{
+    struct hlist_node   node;
+    void*               cpu_addr;
+    struct dma_pool*    pool;
+    int                 cls;
+} kcl_pci_dma_block_t;
+
+static LIST_HEAD(kcl_pci_dma_pools_list);
+static DEFINE_SPINLOCK(kcl_pci_dma_pools_lock);     /* pools list and block hash */
+static struct hlist_head kcl_pci_dma_blocks[1 << KCL_PCI_DMA_BLOCK_HASH_BITS];
+
+static atomic_long_t kcl_pci_dma_pool_allocs = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_pci_dma_pool_frees = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_pci_dma_large_allocs = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_pci_dma_large_frees = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_pci_dma_pool_bytes_requested = ATOMIC_LONG_INIT(0);
+static atomic_long_t kcl_pci_dma_pool_bytes_used = ATOMIC_LONG_INIT(0);
+
+/* Return the size class of an allocation, -1 for the large block path */
+static int kcl_pci_dma_pool_class(int size)
+{
+    int shift = KCL_PCI_DMA_POOL_MIN_SHIFT;
+
+    if (size <= 0)
+    {
+        return -1;
+    }
+
+    while ((1 << shift) < size)
+    {
+        if (++shift > KCL_PCI_DMA_POOL_MAX_SHIFT)
+        {
+            return -1;
+        }
+    }
+
+    return shift - KCL_PCI_DMA_POOL_MIN_SHIFT;
+}
+
+static struct dma_pool* kcl_pci_dma_pool_get(struct pci_dev* pdev, int size)
+{
+    kcl_pci_dma_pools_t* pools;
+    struct dma_pool* pool = NULL;
+    int cls = kcl_pci_dma_pool_class(size);
+
+    if (cls < 0)
+    {
+        return NULL;
+    }
+
+    spin_lock(&kcl_pci_dma_pools_lock);
+    list_for_each_entry(pools, &kcl_pci_dma_pools_list, list)
+    {
+        if (pools->pdev == pdev)
+        {
+            pool = pools->pool[cls];
+            break;
+        }
+    }
+    spin_unlock(&kcl_pci_dma_pools_lock);
+
+    return pool;
+}
+
+/* Remove and return the record of a pooled block, NULL for a large block */
+static kcl_pci_dma_block_t* kcl_pci_dma_block_take(void* cpu_addr)
+{
+    struct hlist_head* head = &kcl_pci_dma_blocks[hash_ptr(cpu_addr, KCL_PCI_DMA_BLOCK_HASH_BITS)];
+    struct hlist_node* pos;
+    kcl_pci_dma_block_t* block = NULL;
+
+    spin_lock(&kcl_pci_dma_pools_lock);
+    for (pos = head->first; pos; pos = pos->next)
+    {
+        kcl_pci_dma_block_t* b = hlist_entry(pos, kcl_pci_dma_block_t, node);
+
+        if (b->cpu_addr == cpu_addr)
+        {
+            hlist_del(&b->node);
+            block = b;
+            break;
+        }
+    }
+    spin_unlock(&kcl_pci_dma_pools_lock);
+
+    return block;
+}
+
+/** \brief Create the DMA coherent memory pools of a device
+ * Allocations made before the pools exist go to pci_alloc_consistent and
+ * are freed the same way.
+ ** \param dev [in] PCI device handle
+ ** \return 0 on success, -ENOMEM otherwise
+ */
+int ATI_API_CALL KCL_PCI_DmaPoolInit(KCL_PCI_DevHandle dev)
+{
+    struct pci_dev* pdev = (struct pci_dev*)dev;
+    kcl_pci_dma_pools_t* pools;
+    int i;
+
+    pools = kzalloc(sizeof(*pools), GFP_KERNEL);
+    if (!pools)
+    {
+        return -ENOMEM;
+    }
+
+    pools->pdev = pdev;
+
+    for (i = 0; i < KCL_PCI_DMA_POOL_CLASSES; i++)
+    {
+        size_t size = 1 << (i + KCL_PCI_DMA_POOL_MIN_SHIFT);
+
+        pools->pool[i] = dma_pool_create(kcl_pci_dma_pool_names[i], &pdev->dev, size, size, 0);
+        if (!pools->pool[i])
+        {
+            while (i--)
+            {
+                dma_pool_destroy(pools->pool[i]);
+            }
+            kfree(pools);
+            return -ENOMEM;
+        }
+    }
+
+    spin_lock(&kcl_pci_dma_pools_lock);
+    list_add(&pools->list, &kcl_pci_dma_pools_list);
+    spin_unlock(&kcl_pci_dma_pools_lock);
+
+    return 0;
+}
+
+/** \brief Destroy the DMA coherent memory pools of a device
+ * Must be called after all pooled memory of the device is freed. Later
+ * allocations go to pci_alloc_consistent.
+ ** \param dev [in] PCI device handle
+ */
+void ATI_API_CALL KCL_PCI_DmaPoolCleanup(KCL_PCI_DevHandle dev)
+{
+    kcl_pci_dma_pools_t* pools;
+    kcl_pci_dma_pools_t* found = NULL;
+    int i;
+
+    spin_lock(&kcl_pci_dma_pools_lock);
+    list_for_each_entry(pools, &kcl_pci_dma_pools_list, list)
+    {
+        if (pools->pdev == (struct pci_dev*)dev)
+        {
+            found = pools;
+            list_del(&found->list);
+            break;
+        }
+    }
+    spin_unlock(&kcl_pci_dma_pools_lock);
+
+    if (!found)
+    {
+        return;
+    }
+
+    for (i = 0; i < KCL_PCI_DMA_POOL_CLASSES; i++)
+    {
+        dma_pool_destroy(found->pool[i]);
+    }
+    kfree(found);
+}
+
+/** \brief Get DMA coherent memory allocation statistics
+ ** \param stats [out] Counters of the pooled and the large block paths
+ */
+void ATI_API_CALL KCL_PCI_GetDmaPoolStats(KCL_PCI_DmaPoolStats* stats)
+{
+    stats->pool_allocs = atomic_long_read(&kcl_pci_dma_pool_allocs);
+    stats->pool_frees = atomic_long_read(&kcl_pci_dma_pool_frees);
+    stats->large_allocs = atomic_long_read(&kcl_pci_dma_large_allocs);
+    stats->large_frees = atomic_long_read(&kcl_pci_dma_large_frees);
+    stats->pool_bytes_requested = atomic_long_read(&kcl_pci_dma_pool_bytes_requested);
+    stats->pool_bytes_used = atomic_long_read(&kcl_pci_dma_pool_bytes_used);
+}
+
 /** \brief Allocate DMA coherent memory
  ** \param dev [in] PCI device handle
  ** \param size [in] Memory size
@@ -318,19 +527,80 @@ void ATI_API_CALL KCL_PCI_DisableDevice(KCL_PCI_DevHandle dev)
 void* ATI_API_CALL KCL_PCI_AllocDmaCoherentMem(
     KCL_PCI_DevHandle dev, int size, unsigned long long* dma_handle_ptr)
 {
-    return (pci_alloc_consistent((struct pci_dev*)dev, size, dma_handle_ptr));
+    struct dma_pool* pool = kcl_pci_dma_pool_get((struct pci_dev*)dev, size);
+    kcl_pci_dma_block_t* block = NULL;
+    dma_addr_t dma_handle;
+    void* cpu_addr;
+
+    if (pool)
+    {
+        block = kmalloc(sizeof(*block), GFP_ATOMIC);
+    }
+
+    if (!block)
+    {
+        cpu_addr = pci_alloc_consistent((struct pci_dev*)dev, size, dma_handle_ptr);
+        if (cpu_addr)
+        {
+            atomic_long_inc(&kcl_pci_dma_large_allocs);
+        }
+        return cpu_addr;
+    }
+
+    /* Same allocation context as pci_alloc_consistent */
+    cpu_addr = dma_pool_alloc(pool, GFP_ATOMIC, &dma_handle);
+    if (!cpu_addr)
+    {
+        kfree(block);
+        return NULL;
+    }
+
+    /* Pooled blocks are recycled, clear them like fresh coherent memory */
+    memset(cpu_addr, 0, size);
+    *dma_handle_ptr = dma_handle;
+
+    block->cpu_addr = cpu_addr;
+    block->pool = pool;
+    block->cls = kcl_pci_dma_pool_class(size);
+
+    spin_lock(&kcl_pci_dma_pools_lock);
+    hlist_add_head(&block->node, &kcl_pci_dma_blocks[hash_ptr(cpu_addr, KCL_PCI_DMA_BLOCK_HASH_BITS)]);
+    spin_unlock(&kcl_pci_dma_pools_lock);
+
+    atomic_long_inc(&kcl_pci_dma_pool_allocs);
+    atomic_long_add(size, &kcl_pci_dma_pool_bytes_requested);
+    atomic_long_add(1 << (block->cls + KCL_PCI_DMA_POOL_MIN_SHIFT),
+                    &kcl_pci_dma_pool_bytes_used);
+
+    return cpu_addr;
 }
 
 /** \brief Free DMA coherent memory
  ** \param dev [in] PCI device handle
- ** \param size [in] Memory size
+ ** \param size [in] Memory size, the same as passed to KCL_PCI_AllocDmaCoherentMem
  ** \param cpu_addr [in] Virtual memory address
  ** \param dma_handle [in] Physical (DMA) memory address
  */
 void ATI_API_CALL KCL_PCI_FreeDmaCoherentMem(
     KCL_PCI_DevHandle dev, int size, void* cpu_addr, unsigned long long dma_handle)
 {
-    pci_free_consistent((struct pci_dev*)dev, size, cpu_addr, dma_handle);
+    kcl_pci_dma_block_t* block = kcl_pci_dma_block_take(cpu_addr);
+
+    if (!block)
+    {
+        pci_free_consistent((struct pci_dev*)dev, size, cpu_addr, dma_handle);
+        atomic_long_inc(&kcl_pci_dma_large_frees);
+        return;
+    }
+
+    dma_pool_free(block->pool, cpu_addr, dma_handle);
+
+    atomic_long_inc(&kcl_pci_dma_pool_frees);
+    atomic_long_sub(size, &kcl_pci_dma_pool_bytes_requested);
+    atomic_long_sub(1 << (block->cls + KCL_PCI_DMA_POOL_MIN_SHIFT),
+                    &kcl_pci_dma_pool_bytes_used);
+
+    kfree(block);
 }
 #endif //__x86_64__
 
@@ -139,6 +139,20 @@ void ATI_API_CALL KCL_PCI_EnableBars(KCL_PCI_DevHandle dev);
 void ATI_API_CALL KCL_PCI_DisableDevice(KCL_PCI_DevHandle dev);
 
 #if defined(__x86_64__)
+typedef struct
+{
+    unsigned long pool_allocs;
+    unsigned long pool_frees;
+    unsigned long large_allocs;
+    unsigned long large_frees;
+    unsigned long pool_bytes_requested;     /* live bytes requested from the pools */
+    unsigned long pool_bytes_used;          /* live bytes of the pool blocks backing them */
+} KCL_PCI_DmaPoolStats;
+
+int ATI_API_CALL KCL_PCI_DmaPoolInit(KCL_PCI_DevHandle dev);
+void ATI_API_CALL KCL_PCI_DmaPoolCleanup(KCL_PCI_DevHandle dev);
+void ATI_API_CALL KCL_PCI_GetDmaPoolStats(KCL_PCI_DmaPoolStats* stats);
+
 void* ATI_API_CALL KCL_PCI_AllocDmaCoherentMem(
     KCL_PCI_DevHandle dev, int size, unsigned long long* dma_handle);
 
@@ -37,11 +37,20 @@
 #endif
 #include <linux/string.h>
 #include <linux/module.h>
+#include <linux/hardirq.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <asm/cpufeature.h>
+#endif
 
 #include "kcl_config.h"
 #include "kcl_type.h"
 #include "kcl_str.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+extern void ATI_API_CALL KCL_fpu_begin(void);
+extern void ATI_API_CALL KCL_fpu_end(void);
+#endif
+
 /** \brief Fill memory with a constant byte
  *  \param s Pointer to memory
  *  \param c Initializing value
@@ -82,6 +91,173 @@ void* ATI_API_CALL KCL_STR_Memmove(void* d,
     return memmove(d, s, count);
 }
 
+#if defined(__i386__) || defined(__x86_64__)
+/* Below this size the FPU state save costs more than the streaming stores save */
+#define KCL_STR_STREAM_MIN_SIZE     256
+/* The FPU section disables preemption, so it is left after each chunk */
+#define KCL_STR_STREAM_CHUNK_SIZE   (64 * 1024)
+
+/* Streaming stores need SSE2 and a context where the FPU may be used */
+static int kcl_str_stream_usable(KCL_TYPE_SizeSigned count)
+{
+    return (count >= KCL_STR_STREAM_MIN_SIZE) &&
+           boot_cpu_has(X86_FEATURE_XMM2) &&
+           !in_interrupt();
+}
+
+/* Copy 64 byte blocks to a 16 byte aligned destination with non-temporal
+ * stores. The caller owns the FPU. */
+static void kcl_str_stream_copy_blocks(void* d, const void* s, unsigned long blocks)
+{
+    for (; blocks; blocks--)
+    {
+        __asm__ __volatile__(
+            "movdqu   (%0), %%xmm0\n"
+            "movdqu 16(%0), %%xmm1\n"
+            "movdqu 32(%0), %%xmm2\n"
+            "movdqu 48(%0), %%xmm3\n"
+            "movntdq %%xmm0,   (%1)\n"
+            "movntdq %%xmm1, 16(%1)\n"
+            "movntdq %%xmm2, 32(%1)\n"
+            "movntdq %%xmm3, 48(%1)\n"
+            : : "r" (s), "r" (d) : "memory");
+        s = (const char*)s + 64;
+        d = (char*)d + 64;
+    }
+
+    __asm__ __volatile__("sfence" : : : "memory");
+}
+
+/* Fill 64 byte blocks of a 16 byte aligned destination with non-temporal
+ * stores. The caller owns the FPU. xmm0 is loaded and used in the same asm
+ * statement, the compiler does not know about it in between. */
+static void kcl_str_stream_set_blocks(void* d, int c, unsigned long blocks)
+{
+    unsigned int pattern = (unsigned char)c * 0x01010101U;
+
+    if (blocks == 0)
+    {
+        return;
+    }
+
+    __asm__ __volatile__(
+        "movd %2, %%xmm0\n"
+        "pshufd $0, %%xmm0, %%xmm0\n"
+        "1:\n"
+        "movntdq %%xmm0,   (%0)\n"
+        "movntdq %%xmm0, 16(%0)\n"
+        "movntdq %%xmm0, 32(%0)\n"
+        "movntdq %%xmm0, 48(%0)\n"
+        "add $64, %0\n"
+        "dec %1\n"
+        "jnz 1b\n"
+        "sfence\n"
+        : "+r" (d), "+r" (blocks)
+        : "r" (pattern)
+        : "memory", "cc");
+}
+#endif
+
+/** \brief Copy memory area with non-temporal stores. The memory areas may not overlap
+ *
+ *  For write-combined and uncached destinations. The destination is written
+ *  in full 64 byte bursts that bypass the cache, so WC buffers are not
+ *  flushed partially and nothing is read back from the destination. Falls
+ *  back to memcpy without SSE2, in interrupt context and for small sizes.
+ *
+ *  \param d Pointer to destination
+ *  \param s Pointer to source
+ *  \param count Number of bytes to copy
+ *  \return Pointer to destination
+ */
+void* ATI_API_CALL KCL_STR_MemcpyStream(void* d,
+                                        const void* s,
+                                        KCL_TYPE_SizeSigned count)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    char* dst = (char*)d;
+    const char* src = (const char*)s;
+    unsigned long head, chunk;
+
+    if (!kcl_str_stream_usable(count))
+    {
+        return memcpy(d, s, count);
+    }
+
+    head = (16 - ((unsigned long)dst & 15)) & 15;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    count -= head;
+
+    while (count >= 64)
+    {
+        chunk = min_t(unsigned long, count & ~63, KCL_STR_STREAM_CHUNK_SIZE);
+
+        KCL_fpu_begin();
+        kcl_str_stream_copy_blocks(dst, src, chunk / 64);
+        KCL_fpu_end();
+
+        dst += chunk;
+        src += chunk;
+        count -= chunk;
+    }
+
+    memcpy(dst, src, count);
+
+    return d;
+#else
+    return memcpy(d, s, count);
+#endif
+}
+
+/** \brief Fill memory with a constant byte using non-temporal stores
+ *
+ *  See KCL_STR_MemcpyStream.
+ *
+ *  \param s Pointer to memory
+ *  \param c Initializing value
+ *  \param count Number of bytes to initialize
+ *  \return Pointer to initialized memory
+ */
+void* ATI_API_CALL KCL_STR_MemsetStream(void* s,
+                                        int c,
+                                        KCL_TYPE_SizeSigned count)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    char* dst = (char*)s;
+    unsigned long head, chunk;
+
+    if (!kcl_str_stream_usable(count))
+    {
+        return memset(s, c, count);
+    }
+
+    head = (16 - ((unsigned long)dst & 15)) & 15;
+    memset(dst, c, head);
+    dst += head;
+    count -= head;
+
+    while (count >= 64)
+    {
+        chunk = min_t(unsigned long, count & ~63, KCL_STR_STREAM_CHUNK_SIZE);
+
+        KCL_fpu_begin();
+        kcl_str_stream_set_blocks(dst, c, chunk / 64);
+        KCL_fpu_end();
+
+        dst += chunk;
+        count -= chunk;
+    }
+
+    memset(dst, c, count);
+
+    return s;
+#else
+    return memset(s, c, count);
+#endif
+}
+
 /** \brief Compare memory areas
  *  \param s1 Pointer to first memory area
  *  \param s2 Pointer to second memory area
@@ -66,6 +66,14 @@ void* ATI_API_CALL KCL_STR_Memmove(void* s1,
                                    const void* s2,
                                    KCL_TYPE_SizeSigned n);
 
+void* ATI_API_CALL KCL_STR_MemcpyStream(void* d,
+                                        const void* s,
+                                        KCL_TYPE_SizeSigned count);
+
+void* ATI_API_CALL KCL_STR_MemsetStream(void* s,
+                                        int c,
+                                        KCL_TYPE_SizeSigned count);
+
 int ATI_API_CALL KCL_STR_Memcmp(const void* s1,
                                 const void* s2,
                                 KCL_TYPE_SizeSigned n);